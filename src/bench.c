@@ -0,0 +1,979 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <sys/time.h>
+#include "image.h"
+#include "test.h"
+
+double what_time_is_it_now()
+{
+    struct timeval time;
+    if (gettimeofday(&time, NULL))
+    {
+        return 0;
+    }
+    return (double)time.tv_sec + (double)time.tv_usec * .000001;
+}
+
+// Fills a new image with uniform noise in [0, 1).
+// Uses its own generator so benchmarks don't disturb rand() users.
+image make_random_image(int w, int h, int c)
+{
+    image im = make_image(w, h, c);
+    unsigned int state = 12345;
+    for (int i = 0; i < w * h * c; ++i)
+    {
+        state = state * 1664525u + 1013904223u;
+        im.data[i] = (state >> 8) / 16777216.0f;
+    }
+    return im;
+}
+
+float max_abs_difference(image a, image b)
+{
+    float diff = 0;
+    for (int i = 0; i < a.w * a.h * a.c; ++i)
+    {
+        diff = MAX(diff, fabsf(a.data[i] - b.data[i]));
+    }
+    return diff;
+}
+
+// The original column-major convolution, kept as the baseline to measure
+// convolve_image against.
+static image convolve_image_naive(image im, image filter, int preserve)
+{
+    image final = preserve ? make_image(im.w, im.h, im.c) : make_image(im.w, im.h, 1);
+
+    for (int ch = 0; ch < im.c; ++ch)
+    {
+        for (int i = 0; i < im.w; ++i)
+        {
+            for (int j = 0; j < im.h; ++j)
+            {
+                float conv_sum = 0;
+                for (int fx = 0; fx < filter.w; ++fx)
+                {
+                    int x = i + fx - filter.w / 2;
+                    for (int fy = 0; fy < filter.h; ++fy)
+                    {
+                        int y = j + fy - filter.h / 2;
+                        conv_sum += get_pixel(im, x, y, ch) * get_pixel(filter, fx, fy, filter.c == 1 ? 0 : ch);
+                    }
+                }
+                preserve ? set_pixel(final, i, j, ch, conv_sum) : set_pixel(final, i, j, 0, get_pixel(final, i, j, 0) + conv_sum);
+            }
+        }
+    }
+    return final;
+}
+
+static void bench_convolve_one(const char *name, image im, image f, int preserve)
+{
+    double start = what_time_is_it_now();
+    image slow = convolve_image_naive(im, f, preserve);
+    double naive = what_time_is_it_now() - start;
+
+    start = what_time_is_it_now();
+    image fast = convolve_image(im, f, preserve);
+    double blocked = what_time_is_it_now() - start;
+
+    printf("  %-24s %4dx%-4d naive %8.3fs  blocked %8.3fs  speedup %6.2fx  max diff %g\n",
+           name, f.w, f.h, naive, blocked, naive / blocked, max_abs_difference(slow, fast));
+    free_image(slow);
+    free_image(fast);
+}
+
+void bench_convolution()
+{
+    image dog = load_image("data/dog.jpg");
+    image big = make_random_image(4000, 3000, 3);
+    image box = make_box_filter(7);
+    image highpass = make_highpass_filter();
+    image gauss = make_gaussian_filter(2);
+
+    printf("convolve_image on data/dog.jpg (%dx%d):\n", dog.w, dog.h);
+    bench_convolve_one("highpass, preserve=0", dog, highpass, 0);
+    bench_convolve_one("box", dog, box, 1);
+    bench_convolve_one("gaussian sigma=2", dog, gauss, 1);
+
+    printf("convolve_image on synthetic %dx%d:\n", big.w, big.h);
+    bench_convolve_one("highpass, preserve=0", big, highpass, 0);
+    bench_convolve_one("box", big, box, 1);
+
+    free_image(dog);
+    free_image(big);
+    free_image(box);
+    free_image(highpass);
+    free_image(gauss);
+}
+
+static void bench_separable_one(const char *name, image im, image f)
+{
+    double start = what_time_is_it_now();
+    image full = convolve_image_direct(im, f, 1);
+    double direct = what_time_is_it_now() - start;
+
+    start = what_time_is_it_now();
+    image split = convolve_image(im, f, 1);
+    double separable = what_time_is_it_now() - start;
+
+    printf("  %-24s %4dx%-4d direct %8.3fs  separable %8.3fs  speedup %6.2fx  max diff %g\n",
+           name, f.w, f.h, direct, separable, direct / separable, max_abs_difference(full, split));
+    free_image(full);
+    free_image(split);
+}
+
+void bench_separable()
+{
+    image dog = load_image("data/dog.jpg");
+    image filters[] = {make_gx_filter(), make_box_filter(7), make_gaussian_filter(2), make_gaussian_filter(7)};
+    const char *names[] = {"sobel gx", "box", "gaussian sigma=2", "gaussian sigma=7"};
+
+    printf("rank-1 filters on data/dog.jpg (%dx%d):\n", dog.w, dog.h);
+    for (int i = 0; i < 4; ++i)
+    {
+        bench_separable_one(names[i], dog, filters[i]);
+        free_image(filters[i]);
+    }
+    free_image(dog);
+}
+
+// Times direct against FFT convolution for non-separable square filters of
+// growing size, which is what the default FFT threshold is picked from.
+void bench_fft_threshold()
+{
+    image dog = load_image("data/dog.jpg");
+    int threshold = get_fft_convolve_threshold();
+    printf("non-separable filters on data/dog.jpg (%dx%d), fft threshold %d:\n", dog.w, dog.h, threshold);
+    for (int size = 5; size <= 41; size += 4)
+    {
+        image f = make_random_image(size, size, 1);
+        set_fft_convolve_threshold(0);
+        double start = what_time_is_it_now();
+        image direct = convolve_image(dog, f, 1);
+        double direct_time = what_time_is_it_now() - start;
+
+        set_fft_convolve_threshold(1);
+        start = what_time_is_it_now();
+        image freq = convolve_image(dog, f, 1);
+        double fft_time = what_time_is_it_now() - start;
+
+        printf("  %2dx%-2d direct %8.3fs  fft %8.3fs  %s  max diff %g\n", size, size, direct_time, fft_time,
+               fft_time < direct_time ? "fft wins   " : "direct wins", max_abs_difference(direct, freq));
+        free_image(f);
+        free_image(direct);
+        free_image(freq);
+    }
+    set_fft_convolve_threshold(threshold);
+    free_image(dog);
+}
+
+// Times the FIR Gaussian against the recursive one as sigma grows. The
+// recursive filter should cost the same whatever the sigma.
+void bench_recursive_gaussian()
+{
+    image dog = load_image("data/dog.jpg");
+    float sigmas[] = {2, 5, 30};
+    printf("smooth_image on data/dog.jpg (%dx%d):\n", dog.w, dog.h);
+    for (int i = 0; i < 3; ++i)
+    {
+        double start = what_time_is_it_now();
+        image fir = smooth_image(dog, sigmas[i], 1);
+        double fir_time = what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        image iir = smooth_image(dog, sigmas[i], 2);
+        double iir_time = what_time_is_it_now() - start;
+
+        printf("  sigma %4g  fir %8.3fs  iir %8.3fs  speedup %6.2fx  max diff %g\n",
+               sigmas[i], fir_time, iir_time, fir_time / iir_time, max_abs_difference(fir, iir));
+        free_image(fir);
+        free_image(iir);
+    }
+    free_image(dog);
+}
+
+void bench_threads()
+{
+    image big = make_random_image(4000, 3000, 3);
+    image box = make_box_filter(7);
+    int threads = uwimg_get_num_threads();
+    printf("thread scaling on synthetic %dx%d (%d threads by default):\n", big.w, big.h, threads);
+    for (int t = 1; t <= MAX(threads, 4); t *= 2)
+    {
+        uwimg_set_num_threads(t);
+        double start = what_time_is_it_now();
+        image conv = convolve_image(big, box, 1);
+        double conv_time = what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        image resized = bilinear_resize(big, 3000, 2000);
+        double resize_time = what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        rgb_to_hsv(conv);
+        double hsv_time = what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        image smooth = smooth_image(big, 8, 2);
+        double smooth_time = what_time_is_it_now() - start;
+
+        printf("  %2d threads: convolve %7.3fs  resize %7.3fs  rgb_to_hsv %7.3fs  smooth %7.3fs\n",
+               t, conv_time, resize_time, hsv_time, smooth_time);
+        free_image(conv);
+        free_image(resized);
+        free_image(smooth);
+    }
+    uwimg_set_num_threads(threads);
+    free_image(big);
+    free_image(box);
+}
+
+static void bench_harris_allocations(image im, const char *label)
+{
+    for (int run = 0; run < 3; ++run)
+    {
+        int n = 0;
+        reset_image_pool_stats();
+        double start = what_time_is_it_now();
+        descriptor *d = harris_corner_detector(im, 2, 50, 3, &n);
+        double time = what_time_is_it_now() - start;
+        free_descriptors(d, n);
+        char buff[256];
+        sprintf(buff, "  %s, run %d (%.3fs)", label, run, time);
+        print_image_pool_stats(buff);
+    }
+}
+
+void bench_image_pool()
+{
+    image dog = load_image("data/dog.jpg");
+    printf("harris_corner_detector on data/dog.jpg, per call:\n");
+    set_image_pool_limit(0);
+    bench_harris_allocations(dog, "no pool");
+    set_image_pool_limit(256 << 20);
+    bench_harris_allocations(dog, "pooled ");
+    free_image(dog);
+}
+
+// The original scalar loops of load_image_stb and save_image_stb, kept as the
+// baseline to measure u8_to_image and image_to_u8 against.
+static image u8_to_image_naive(const unsigned char *data, int w, int h, int c)
+{
+    image im = make_image(w, h, c);
+    for (int k = 0; k < c; ++k)
+        for (int j = 0; j < h; ++j)
+            for (int i = 0; i < w; ++i)
+                im.data[i + w * j + w * h * k] = (float)data[k + c * i + c * w * j] / 255.;
+    return im;
+}
+
+static void image_to_u8_naive(image im, unsigned char *data)
+{
+    for (int k = 0; k < im.c; ++k)
+        for (int i = 0; i < im.w * im.h; ++i)
+            data[i * im.c + k] = (unsigned char)roundf((255 * im.data[i + k * im.w * im.h]));
+}
+
+// Best of a few runs, so page faults on the first touch of the buffers and
+// the image pool filling up are not counted.
+#define U8_RUNS 3
+
+void bench_u8_conversion()
+{
+    int w = 4000, h = 3000, c = 3;
+    image big = make_random_image(w, h, c);
+    unsigned char *bytes = malloc(w * h * c);
+    double naive = INFINITY, fast = INFINITY;
+    printf("u8 <-> float conversion on synthetic %dx%dx%d (best of %d):\n", w, h, c, U8_RUNS);
+
+    for (int run = 0; run < U8_RUNS; ++run)
+    {
+        double start = what_time_is_it_now();
+        image_to_u8_naive(big, bytes);
+        naive = MIN(naive, what_time_is_it_now() - start);
+        start = what_time_is_it_now();
+        image_to_u8(big, bytes);
+        fast = MIN(fast, what_time_is_it_now() - start);
+    }
+    printf("  save (float -> u8)  naive %7.3fs  simd %7.3fs  speedup %6.2fx\n", naive, fast, naive / fast);
+
+    // Each result is freed before the next is made, so both reuse one pooled
+    // buffer instead of faulting in fresh pages.
+    image reference = u8_to_image_naive(bytes, w, h, c);
+    naive = fast = INFINITY;
+    float diff = 0;
+    for (int run = 0; run < U8_RUNS; ++run)
+    {
+        double start = what_time_is_it_now();
+        image slow = u8_to_image_naive(bytes, w, h, c);
+        naive = MIN(naive, what_time_is_it_now() - start);
+        free_image(slow);
+        start = what_time_is_it_now();
+        image quick = u8_to_image(bytes, w, h, c);
+        fast = MIN(fast, what_time_is_it_now() - start);
+        diff = max_abs_difference(reference, quick);
+        free_image(quick);
+    }
+    printf("  load (u8 -> float)  naive %7.3fs  simd %7.3fs  speedup %6.2fx  max diff %g\n",
+           naive, fast, naive / fast, diff);
+    free_image(reference);
+
+    free_image(big);
+    free(bytes);
+}
+
+// The pre-fusion sobel_image: two full convolutions, then a third pass for
+// magnitude and direction.
+static image *sobel_image_unfused(image im)
+{
+    image *out = calloc(4, sizeof(image));
+    image gx_filter = make_gx_filter();
+    image gy_filter = make_gy_filter();
+    out[0] = convolve_image(im, gx_filter, 0);
+    out[1] = convolve_image(im, gy_filter, 0);
+    out[2] = make_image(im.w, im.h, 1);
+    out[3] = make_image(im.w, im.h, 1);
+    for (int i = 0; i < im.w * im.h; ++i)
+    {
+        float x = out[0].data[i], y = out[1].data[i];
+        out[2].data[i] = sqrt(x * x + y * y);
+        out[3].data[i] = atan2(y, x);
+    }
+    free_image(gx_filter);
+    free_image(gy_filter);
+    return out;
+}
+
+static void free_sobel_outputs(image *out)
+{
+    for (int i = 0; i < 4; ++i)
+        free_image(out[i]);
+    free(out);
+}
+
+void bench_sobel()
+{
+    image big = make_random_image(4000, 3000, 3);
+    double unfused = INFINITY, fused = INFINITY, fast = INFINITY;
+    float mag_diff = 0, dir_diff = 0;
+    printf("sobel gradients on synthetic %dx%dx%d (best of %d):\n", big.w, big.h, big.c, U8_RUNS);
+
+    for (int run = 0; run < U8_RUNS; ++run)
+    {
+        double start = what_time_is_it_now();
+        image *a = sobel_image_unfused(big);
+        unfused = MIN(unfused, what_time_is_it_now() - start);
+
+        start = what_time_is_it_now();
+        image *b = sobel_gradients(big, 0);
+        fused = MIN(fused, what_time_is_it_now() - start);
+        mag_diff = max_abs_difference(a[2], b[2]);
+
+        start = what_time_is_it_now();
+        image *c = sobel_gradients(big, 1);
+        fast = MIN(fast, what_time_is_it_now() - start);
+        dir_diff = max_abs_difference(b[3], c[3]);
+        free_sobel_outputs(c);
+        free_sobel_outputs(b);
+        free_sobel_outputs(a);
+    }
+    printf("  unfused %7.3fs  fused %7.3fs (%5.2fx, mag diff %g)  fused+fast atan2 %7.3fs (%5.2fx, dir diff %g)\n",
+           unfused, fused, unfused / fused, mag_diff, fast, unfused / fast, dir_diff);
+    free_image(big);
+}
+
+void bench_structure()
+{
+    image big = make_random_image(4000, 3000, 3);
+    double unfused = INFINITY, fused = INFINITY;
+    float diff = 0;
+    printf("structure matrix on synthetic %dx%dx%d, sigma=2 (best of %d):\n", big.w, big.h, big.c, U8_RUNS);
+    for (int run = 0; run < U8_RUNS; ++run)
+    {
+        double start = what_time_is_it_now();
+        image a = structure_matrix_reference(big, 2);
+        unfused = MIN(unfused, what_time_is_it_now() - start);
+
+        start = what_time_is_it_now();
+        image b = structure_matrix(big, 2);
+        fused = MIN(fused, what_time_is_it_now() - start);
+        diff = max_abs_difference(a, b);
+        free_image(a);
+        free_image(b);
+    }
+    printf("  per-channel sobel %7.3fs  grayscale first %7.3fs  speedup %5.2fx  max diff %g\n",
+           unfused, fused, unfused / fused, diff);
+    free_image(big);
+}
+
+// Brute-force window scan against the running-max nms_image, whose cost
+// should stay flat as the radius grows. The input is a Harris response
+// thresholded the way harris_corner_detector does it, so most pixels sit on
+// a plateau of ties that the scan has to read in full.
+void bench_nms()
+{
+    image dog = load_image("data/dog.jpg");
+    image S = structure_matrix(dog, 2);
+    image big = cornerness_response(S);
+    float peak = 0;
+    for (int i = 0; i < big.w * big.h; ++i)
+        peak = MAX(peak, big.data[i]);
+    for (int i = 0; i < big.w * big.h; ++i)
+        big.data[i] = big.data[i] < .01 * peak ? -999999 : big.data[i];
+    printf("nms_image on the thresholded Harris response of data/dog.jpg (%dx%d):\n", big.w, big.h);
+    for (int r = 1; r <= 15; ++r)
+    {
+        double start = what_time_is_it_now();
+        image a = nms_image_reference(big, r);
+        double scan = what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        image b = nms_image(big, r);
+        double running = what_time_is_it_now() - start;
+
+        printf("  radius %2d  window scan %7.3fs  running max %7.3fs  speedup %6.2fx  max diff %g\n",
+               r, scan, running, scan / running, max_abs_difference(a, b));
+        free_image(a);
+        free_image(b);
+    }
+    free_image(dog);
+    free_image(S);
+    free_image(big);
+}
+
+// Corner count and the cost of matching the corners of an image against a
+// shifted crop of itself, with and without a cap on corners per image.
+void bench_max_features()
+{
+    image forest = load_image("data/forest.jpg");
+    image crop = from_strided_image(image_view(forest, 20, 10, forest.w - 40, forest.h - 20));
+    panorama_options opt = {0};
+    int caps[] = {0, 2000, 500};
+    printf("harris + match_descriptor_sets, data/forest.jpg (%dx%d) against a crop:\n", forest.w, forest.h);
+    for (int k = 0; k < 3; ++k)
+    {
+        int mn = 0;
+        opt.max_features = caps[k];
+        double start = what_time_is_it_now();
+        descriptor_set ad = harris_descriptor_set_ex(image_as_strided(forest), 2, 50, 3, &opt);
+        descriptor_set bd = harris_descriptor_set_ex(image_as_strided(crop), 2, 50, 3, &opt);
+        double detect = what_time_is_it_now() - start;
+
+        start = what_time_is_it_now();
+        match *m = match_descriptor_sets(ad, bd, &mn);
+        double matching = what_time_is_it_now() - start;
+
+        printf("  max features %5d: %6d + %6d corners  detect %7.3fs  match %8.3fs  %d matches\n",
+               caps[k], ad.n, bd.n, detect, matching, mn);
+        free(m);
+        free_descriptor_set(ad);
+        free_descriptor_set(bd);
+    }
+    free_image(forest);
+    free_image(crop);
+}
+
+// Nearest-neighbour search over random 75-float descriptors, one scalar
+// l1_distance call per pair against the batched l1_nearest_two kernel.
+void bench_l1_matching()
+{
+    int n = 3000, dim = 75;
+    image noise = make_random_image(dim, 2 * n, 1);
+    descriptor_set a = make_descriptor_set(n, dim), b = make_descriptor_set(n, dim);
+    for (int i = 0; i < n; ++i)
+    {
+        memcpy(strided_row(a.rows, 0, i), noise.data + i * dim, dim * sizeof(float));
+        memcpy(strided_row(b.rows, 0, i), noise.data + (n + i) * dim, dim * sizeof(float));
+    }
+    printf("L1 nearest neighbours, %d x %d descriptors of %d floats:\n", n, n, dim);
+
+    double start = what_time_is_it_now();
+    long scalar_sum = 0;
+    for (int j = 0; j < n; ++j)
+    {
+        float best = FLT_MAX;
+        int bi = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            float d = l1_distance(strided_row(a.rows, 0, j), strided_row(b.rows, 0, i), dim);
+            if (d < best)
+            {
+                best = d;
+                bi = i;
+            }
+        }
+        scalar_sum += bi;
+    }
+    double scalar = what_time_is_it_now() - start;
+
+    start = what_time_is_it_now();
+    long batch_sum = 0;
+    for (int j = 0; j < n; ++j)
+        batch_sum += l1_nearest_two(strided_row(a.rows, 0, j), b.rows, 0, n).best;
+    double batch = what_time_is_it_now() - start;
+
+    printf("  l1_distance %7.3fs  l1_nearest_two %7.3fs  speedup %6.2fx  same matches: %s\n", scalar, batch,
+           scalar / batch, scalar_sum == batch_sum ? "yes" : "no");
+    free_image(noise);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+}
+
+// Exhaustive against KD-forest matching of an image against a shifted, noisy
+// crop of itself, at a few check counts. Recall is the share of returned
+// matches whose b descriptor is the exact nearest neighbour of its a
+// descriptor.
+static void bench_ann_one(image im, int nms)
+{
+    image crop = from_strided_image(image_view(im, 20, 10, im.w - 40, im.h - 20));
+    image noise = make_random_image(crop.w, crop.h, crop.c);
+    for (int i = 0; i < crop.w * crop.h * crop.c; ++i)
+        crop.data[i] += .05 * (noise.data[i] - .5);
+    free_image(noise);
+    descriptor_set a = harris_descriptor_set(im, 2, 50, nms);
+    descriptor_set b = harris_descriptor_set(crop, 2, 50, nms);
+    panorama_options opt = {0};
+    printf("  %dx%d, nms %d: %d x %d descriptors\n", im.w, im.h, nms, a.n, b.n);
+
+    int *best = calloc(a.n, sizeof(int));
+    for (int i = 0; i < a.n; ++i)
+        best[i] = l1_nearest_two(strided_row(a.rows, 0, i), b.rows, 0, b.n).best;
+
+    int levels[] = {0, 32, 64, 128, 256, 512};
+    double exhaustive = 0;
+    for (int k = 0; k < 6; ++k)
+    {
+        int mn = 0;
+        opt.ann_checks = levels[k];
+        double start = what_time_is_it_now();
+        match *m = match_descriptor_sets_ex(a, b, &mn, &opt);
+        double time = what_time_is_it_now() - start;
+        int found = 0;
+        for (int i = 0; i < mn; ++i)
+            found += m[i].bi == best[m[i].ai];
+        if (!levels[k])
+        {
+            exhaustive = time;
+            printf("    exhaustive      %8.3fs                  recall %6.2f%%\n", time, 100. * found / MAX(mn, 1));
+        }
+        else
+        {
+            printf("    checks %4d     %8.3fs  speedup %6.2fx  recall %6.2f%%\n", levels[k], time, exhaustive / time,
+                   100. * found / MAX(mn, 1));
+        }
+        free(m);
+    }
+    free(best);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(crop);
+}
+
+void bench_ann_matching()
+{
+    image forest = load_image("data/forest.jpg");
+    image big = bilinear_resize(forest, 2 * forest.w, 2 * forest.h);
+    printf("approximate matching (4-tree KD-forest) on data/forest.jpg against a noisy crop:\n");
+    bench_ann_one(forest, 3);
+    bench_ann_one(big, 1);
+    free_image(forest);
+    free_image(big);
+}
+
+// Exhaustive L1 matching against L2 matching through the blocked product,
+// and against L2 one pair at a time, on forest.jpg and twice its size
+// against shifted, noisy crops.
+static void bench_l2_one(image im, int nms)
+{
+    image crop = from_strided_image(image_view(im, 20, 10, im.w - 40, im.h - 20));
+    image noise = make_random_image(crop.w, crop.h, crop.c);
+    for (int i = 0; i < crop.w * crop.h * crop.c; ++i)
+        crop.data[i] += .05 * (noise.data[i] - .5);
+    free_image(noise);
+    descriptor_set a = harris_descriptor_set(im, 2, 50, nms);
+    descriptor_set b = harris_descriptor_set(crop, 2, 50, nms);
+    panorama_options opt = {0};
+    printf("  %dx%d, nms %d: %d x %d descriptors\n", im.w, im.h, nms, a.n, b.n);
+
+    double start = what_time_is_it_now();
+    int *naive = malloc(a.n * sizeof(int));
+    for (int j = 0; j < a.n; ++j)
+    {
+        const float *q = strided_row(a.rows, 0, j);
+        float best = FLT_MAX;
+        naive[j] = 0;
+        for (int i = 0; i < b.n; ++i)
+        {
+            const float *r = strided_row(b.rows, 0, i);
+            float d = 0;
+            for (int k = 0; k < a.dim; ++k)
+                d += (q[k] - r[k]) * (q[k] - r[k]);
+            if (d < best)
+            {
+                best = d;
+                naive[j] = i;
+            }
+        }
+    }
+    double pairwise = what_time_is_it_now() - start;
+
+    int ln = 0, gn = 0, lright = 0, gright = 0, same = 0;
+    start = what_time_is_it_now();
+    match *lm = match_descriptor_sets(a, b, &ln);
+    double l1 = what_time_is_it_now() - start;
+    opt.metric = MATCH_L2;
+    start = what_time_is_it_now();
+    match *gm = match_descriptor_sets_ex(a, b, &gn, &opt);
+    double gemm = what_time_is_it_now() - start;
+
+    for (int i = 0; i < ln; ++i)
+        lright += lm[i].p.x - lm[i].q.x == 20 && lm[i].p.y - lm[i].q.y == 10;
+    for (int i = 0; i < gn; ++i)
+    {
+        gright += gm[i].p.x - gm[i].q.x == 20 && gm[i].p.y - gm[i].q.y == 10;
+        same += gm[i].bi == naive[gm[i].ai];
+    }
+    printf("    L1 exhaustive %8.3fs                  right %6.2f%%\n", l1, 100. * lright / MAX(ln, 1));
+    printf("    L2 pairwise   %8.3fs\n", pairwise);
+    printf("    L2 blocked    %8.3fs  speedup %6.2fx  right %6.2f%%  same as pairwise %6.2f%%\n", gemm,
+           pairwise / gemm, 100. * gright / MAX(gn, 1), 100. * same / MAX(gn, 1));
+    free(naive);
+    free(lm);
+    free(gm);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(crop);
+}
+
+void bench_l2_matching()
+{
+    image forest = load_image("data/forest.jpg");
+    image big = bilinear_resize(forest, 2 * forest.w, 2 * forest.h);
+    printf("L2 matching by blocked matrix product on data/forest.jpg against a noisy crop:\n");
+    bench_l2_one(forest, 3);
+    bench_l2_one(big, 1);
+    free_image(forest);
+    free_image(big);
+}
+
+// Plain nearest-neighbour matching against the ratio test and the mutual
+// check, on forest.jpg against a shifted, very noisy crop. The share of right
+// matches sets how many 4-match RANSAC samples it takes to draw an all-right
+// one with 99% confidence.
+void bench_match_filters()
+{
+    image im = load_image("data/forest.jpg");
+    image crop = from_strided_image(image_view(im, 20, 10, im.w - 40, im.h - 20));
+    image noise = make_random_image(crop.w, crop.h, crop.c);
+    for (int i = 0; i < crop.w * crop.h * crop.c; ++i)
+        crop.data[i] += .5 * (noise.data[i] - .5);
+    descriptor_set a = harris_descriptor_set(im, 2, 50, 3), b = harris_descriptor_set(crop, 2, 50, 3);
+    panorama_options opt = {0};
+    printf("match filters, data/forest.jpg against a very noisy crop, %d x %d descriptors:\n", a.n, b.n);
+
+    const char *names[] = {"plain", "ratio .8", "mutual", "ratio .8 + mutual"};
+    float ratios[] = {0, .8, 0, .8};
+    int mutuals[] = {0, 0, 1, 1};
+    for (int k = 0; k < 4; ++k)
+    {
+        int mn = 0, right = 0;
+        opt.match_ratio = ratios[k];
+        opt.match_mutual = mutuals[k];
+        double start = what_time_is_it_now();
+        match *m = match_descriptor_sets_ex(a, b, &mn, &opt);
+        double time = what_time_is_it_now() - start;
+        for (int i = 0; i < mn; ++i)
+            right += m[i].p.x - m[i].q.x == 20 && m[i].p.y - m[i].q.y == 10;
+        double w = (double)right / MAX(mn, 1);
+        double iters = w >= 1 ? 1 : ceil(log(.01) / log(1 - pow(w, 4)));
+        printf("  %-18s %7.3fs  %5d matches  right %6.2f%%  RANSAC samples for 99%% %6.0f\n", names[k], time, mn,
+               100 * w, iters);
+        free(m);
+    }
+
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(noise);
+    free_image(crop);
+    free_image(im);
+}
+
+// RANSAC as it was: shuffle every match, solve through heap matrices and
+// project each match through project_point, which allocates too.
+static matrix ransac_allocating(match *m, int n, float thresh, int k, int cutoff)
+{
+    int best = 0;
+    matrix Hb = make_translation_homography(256, 0);
+    for (int i = 0; i < k; ++i)
+    {
+        randomize_matches(m, n);
+        match *sample = calloc(4, sizeof(match));
+        memcpy(sample, m, 4 * sizeof(match));
+        matrix H = compute_homography(sample, 4);
+        free(sample);
+        if (!H.data)
+            continue;
+        int inliers = 0;
+        for (int j = 0; j < n; ++j)
+        {
+            point p = project_point(H, m[j].p);
+            inliers += (p.x - m[j].q.x) * (p.x - m[j].q.x) + (p.y - m[j].q.y) * (p.y - m[j].q.y) < thresh * thresh;
+        }
+        if (inliers > best)
+        {
+            best = inliers;
+            free_matrix(Hb);
+            Hb = H;
+            if (inliers > cutoff)
+                break;
+        }
+        else
+        {
+            free_matrix(H);
+        }
+    }
+    return Hb;
+}
+
+// The old RANSAC loop against the allocation-free one on the matches between
+// forest.jpg and a shifted, noisy crop, running every iteration.
+void bench_ransac()
+{
+    image im = load_image("data/forest.jpg");
+    image crop = from_strided_image(image_view(im, 20, 10, im.w - 40, im.h - 20));
+    image noise = make_random_image(crop.w, crop.h, crop.c);
+    for (int i = 0; i < crop.w * crop.h * crop.c; ++i)
+        crop.data[i] += .05 * (noise.data[i] - .5);
+    descriptor_set a = harris_descriptor_set(im, 2, 50, 3), b = harris_descriptor_set(crop, 2, 50, 3);
+    int mn = 0;
+    match *m = match_descriptor_sets(a, b, &mn);
+    printf("RANSAC on %d matches from data/forest.jpg against a noisy crop:\n", mn);
+
+    int k = 1000;
+    srand(10);
+    double start = what_time_is_it_now();
+    matrix old = ransac_allocating(m, mn, 2, k, mn);
+    double allocating = what_time_is_it_now() - start;
+    srand(10);
+    start = what_time_is_it_now();
+    matrix H = RANSAC(m, mn, 2, k, mn);
+    double in_place = what_time_is_it_now() - start;
+    printf("  %d iterations: allocating %7.3fs (%d inliers)  in place %7.3fs (%d inliers)  speedup %6.2fx\n", k,
+           allocating, model_inliers(old, m, mn, 2), in_place, model_inliers(H, m, mn, 2), allocating / in_place);
+    free_matrix(H);
+
+    k = 50000;
+    start = what_time_is_it_now();
+    H = RANSAC(m, mn, 2, k, mn);
+    printf("  %d iterations: in place %7.3fs (%d inliers)\n", k, what_time_is_it_now() - start,
+           model_inliers(H, m, mn, 2));
+
+    free_matrix(H);
+    free_matrix(old);
+    free(m);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(noise);
+    free_image(crop);
+    free_image(im);
+}
+
+// RANSAC's 50000 fixed iterations against the adaptive stopping rule and the
+// SPRT, on the plain matches between forest.jpg and a very noisy crop.
+void bench_adaptive_ransac()
+{
+    image im = load_image("data/forest.jpg");
+    image crop = from_strided_image(image_view(im, 20, 10, im.w - 40, im.h - 20));
+    image noise = make_random_image(crop.w, crop.h, crop.c);
+    for (int i = 0; i < crop.w * crop.h * crop.c; ++i)
+        crop.data[i] += .5 * (noise.data[i] - .5);
+    descriptor_set a = harris_descriptor_set(im, 2, 50, 3), b = harris_descriptor_set(crop, 2, 50, 3);
+    panorama_options opt = {0};
+    int mn = 0;
+    match *m = match_descriptor_sets(a, b, &mn);
+    printf("adaptive RANSAC on %d matches from data/forest.jpg against a very noisy crop:\n", mn);
+
+    const char *names[] = {"fixed", "99% confidence", "SPRT", "99% + SPRT"};
+    float confidences[] = {0, .99, 0, .99};
+    int sprts[] = {0, 0, 1, 1};
+    double fixed = 0;
+    for (int k = 0; k < 4; ++k)
+    {
+        ransac_stats stats;
+        opt.ransac_confidence = confidences[k];
+        opt.ransac_sprt = sprts[k];
+        srand(10);
+        double start = what_time_is_it_now();
+        matrix H = RANSAC_ex(m, mn, 2, 50000, mn, &opt, &stats);
+        double time = what_time_is_it_now() - start;
+        if (!k)
+            fixed = time;
+        printf("  %-15s %7.3fs  speedup %7.2fx  %5d iterations  %9ld checks  %4d inliers\n", names[k], time,
+               fixed / time, stats.iterations, stats.checks, model_inliers(H, m, mn, 2));
+        free_matrix(H);
+    }
+
+    free(m);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(noise);
+    free_image(crop);
+    free_image(im);
+}
+
+// Uniform against PROSAC sampling on the distance-sorted plain matches
+// between forest.jpg and a very noisy crop, averaged over 20 seeds: until
+// RANSAC passes a cutoff of 90% of the inliers, and under the 99% confidence
+// stopping rule with SPRT.
+void bench_prosac()
+{
+    image im = load_image("data/forest.jpg");
+    image crop = from_strided_image(image_view(im, 20, 10, im.w - 40, im.h - 20));
+    image noise = make_random_image(crop.w, crop.h, crop.c);
+    for (int i = 0; i < crop.w * crop.h * crop.c; ++i)
+        crop.data[i] += .5 * (noise.data[i] - .5);
+    descriptor_set a = harris_descriptor_set(im, 2, 50, 3), b = harris_descriptor_set(crop, 2, 50, 3);
+    panorama_options opt = {0};
+    int mn = 0, right = 0;
+    match *m = match_descriptor_sets(a, b, &mn);
+    for (int i = 0; i < mn; ++i)
+        right += m[i].p.x - m[i].q.x == 20 && m[i].p.y - m[i].q.y == 10;
+    printf("PROSAC on %d matches (%d right) from data/forest.jpg against a very noisy crop:\n", mn, right);
+
+    const char *names[] = {"uniform, cutoff", "PROSAC, cutoff", "uniform, 99% + SPRT", "PROSAC, 99% + SPRT"};
+    ransac_sampler samplers[] = {SAMPLE_UNIFORM, SAMPLE_PROSAC, SAMPLE_UNIFORM, SAMPLE_PROSAC};
+    int seeds = 20;
+    for (int k = 0; k < 4; ++k)
+    {
+        int cutoff = k < 2 ? .9 * right : mn;
+        opt.sampler = samplers[k];
+        opt.ransac_confidence = k < 2 ? 0 : .99;
+        opt.ransac_sprt = k >= 2;
+        double iterations = 0, found = 0, time = 0;
+        int inliers = 0;
+        for (int seed = 0; seed < seeds; ++seed)
+        {
+            srand(seed);
+            double start = what_time_is_it_now();
+            ransac_stats stats;
+            matrix H = RANSAC_ex(m, mn, 2, 50000, cutoff, &opt, &stats);
+            time += what_time_is_it_now() - start;
+            iterations += stats.iterations;
+            found += stats.best_iteration;
+            inliers += model_inliers(H, m, mn, 2);
+            free_matrix(H);
+        }
+        printf("  %-20s %8.1f iterations  best at %8.1f  %7.4fs  %6.1f inliers\n", names[k], iterations / seeds,
+               found / seeds, time / seeds, (double)inliers / seeds);
+    }
+
+    free(m);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(noise);
+    free_image(crop);
+    free_image(im);
+}
+
+// Float patch descriptors matched by L1 against 256-bit binary ones matched
+// by Hamming distance and int8 ones matched by SAD, on forest.jpg against a
+// shifted, noisy crop. A match is right when it recovers the shift.
+void bench_binary_descriptors()
+{
+    image im = load_image("data/forest.jpg");
+    image crop = from_strided_image(image_view(im, 20, 10, im.w - 40, im.h - 20));
+    image noise = make_random_image(crop.w, crop.h, crop.c);
+    for (int i = 0; i < crop.w * crop.h * crop.c; ++i)
+        crop.data[i] += .05 * (noise.data[i] - .5);
+    printf("float, binary and int8 descriptors, data/forest.jpg against a noisy crop:\n");
+
+    double start = what_time_is_it_now();
+    descriptor_set fa = harris_descriptor_set(im, 2, 50, 3), fb = harris_descriptor_set(crop, 2, 50, 3);
+    double float_describe = what_time_is_it_now() - start;
+    start = what_time_is_it_now();
+    binary_descriptor_set ba = harris_binary_descriptor_set(im, 2, 50, 3),
+                          bb = harris_binary_descriptor_set(crop, 2, 50, 3);
+    double binary_describe = what_time_is_it_now() - start;
+
+    start = what_time_is_it_now();
+    quantized_descriptor_set qa = harris_quantized_descriptor_set(im, 2, 50, 3),
+                             qb = harris_quantized_descriptor_set(crop, 2, 50, 3);
+    double quantized_describe = what_time_is_it_now() - start;
+
+    int fn = 0, bn = 0, qn = 0, fright = 0, bright = 0, qright = 0, agree = 0;
+    start = what_time_is_it_now();
+    match *fm = match_descriptor_sets(fa, fb, &fn);
+    double float_match = what_time_is_it_now() - start;
+    start = what_time_is_it_now();
+    match *bm = match_binary_descriptor_sets(ba, bb, &bn);
+    double binary_match = what_time_is_it_now() - start;
+    start = what_time_is_it_now();
+    match *qm = match_quantized_descriptor_sets(qa, qb, &qn);
+    double quantized_match = what_time_is_it_now() - start;
+
+    int *float_bi = malloc(fa.n * sizeof(int));
+    for (int i = 0; i < fa.n; ++i)
+        float_bi[i] = -1;
+    for (int i = 0; i < fn; ++i)
+    {
+        fright += fm[i].p.x - fm[i].q.x == 20 && fm[i].p.y - fm[i].q.y == 10;
+        float_bi[fm[i].ai] = fm[i].bi;
+    }
+    for (int i = 0; i < bn; ++i)
+        bright += bm[i].p.x - bm[i].q.x == 20 && bm[i].p.y - bm[i].q.y == 10;
+    for (int i = 0; i < qn; ++i)
+    {
+        qright += qm[i].p.x - qm[i].q.x == 20 && qm[i].p.y - qm[i].q.y == 10;
+        agree += float_bi[qm[i].ai] == qm[i].bi;
+    }
+
+    printf("  float  %5d x %-5d  %4d bytes each  describe %7.3fs  match %7.3fs  right %6.2f%%\n", fa.n, fb.n,
+           (int)(fa.rows.stride * sizeof(float)), float_describe, float_match, 100. * fright / MAX(fn, 1));
+    printf("  binary %5d x %-5d  %4d bytes each  describe %7.3fs  match %7.3fs  right %6.2f%%\n", ba.n, bb.n,
+           (int)(BINARY_DESCRIPTOR_WORDS * sizeof(uint64_t)), binary_describe, binary_match,
+           100. * bright / MAX(bn, 1));
+    printf("  int8   %5d x %-5d  %4d bytes each  describe %7.3fs  match %7.3fs  right %6.2f%%  same as float %6.2f%%\n",
+           qa.n, qb.n, qa.stride, quantized_describe, quantized_match, 100. * qright / MAX(qn, 1),
+           100. * agree / MAX(qn, 1));
+
+    free(float_bi);
+    free(fm);
+    free(bm);
+    free(qm);
+    free_descriptor_set(fa);
+    free_descriptor_set(fb);
+    free_binary_descriptor_set(ba);
+    free_binary_descriptor_set(bb);
+    free_quantized_descriptor_set(qa);
+    free_quantized_descriptor_set(qb);
+    free_image(noise);
+    free_image(crop);
+    free_image(im);
+}
+
+void run_benchmarks()
+{
+    bench_convolution();
+    bench_separable();
+    bench_fft_threshold();
+    bench_recursive_gaussian();
+    bench_threads();
+    bench_image_pool();
+    bench_u8_conversion();
+    bench_sobel();
+    bench_structure();
+    bench_nms();
+    bench_max_features();
+    bench_l1_matching();
+    bench_ann_matching();
+    bench_binary_descriptors();
+    bench_l2_matching();
+    bench_match_filters();
+    bench_ransac();
+    bench_adaptive_ransac();
+    bench_prosac();
+}
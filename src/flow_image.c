@@ -5,6 +5,7 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
 
 // Draws a line on an image with color corresponding to the direction of line
 // image im: image to draw line on
@@ -136,6 +137,30 @@ image box_filter_image(image im, int s)
     return S;
 }
 
+// Gradients and the time-structure matrix built from them, shared by the
+// threads filling it in.
+typedef struct
+{
+    image ix, iy, it, S;
+} time_structure_job;
+
+// Writes the five gradient products for pixels [start, end).
+static void time_structure_products(void *ctx, int start, int end)
+{
+    time_structure_job *job = ctx;
+    int plane = job->S.w * job->S.h;
+    const float *ix = job->ix.data, *iy = job->iy.data, *it = job->it.data;
+    float *S = job->S.data;
+    for (int i = start; i < end; ++i)
+    {
+        S[i] = ix[i] * ix[i];
+        S[plane + i] = iy[i] * iy[i];
+        S[2 * plane + i] = ix[i] * iy[i];
+        S[3 * plane + i] = ix[i] * it[i];
+        S[4 * plane + i] = iy[i] * it[i];
+    }
+}
+
 // Calculate the time-structure matrix of an image pair.
 // image im: the input image.
 // image prev: the previous image in sequence.
@@ -155,7 +180,6 @@ image time_structure_matrix(image im, image prev, int s)
 
     image time_gradients = sub_image(im, prev);
 
-    float temp;
     image S = make_image(im.w, im.h, 5);
     image sobel_x_filter = make_gx_filter();
     image sobel_y_filter = make_gy_filter();
@@ -163,40 +187,13 @@ image time_structure_matrix(image im, image prev, int s)
     image intensity_x = convolve_image(im, sobel_x_filter, 1);
     image intensity_y = convolve_image(im, sobel_y_filter, 1);
 
-    for (int i = 0; i < S.w; ++i)
-    {
-        for (int j = 0; j < S.h; ++j)
-        {
-            for (int ch = 0; ch < S.c; ++ch)
-            {
-
-                if (ch == 0)
-                {
-                    temp = get_pixel(intensity_x, i, j, 0) * get_pixel(intensity_x, i, j, 0);
-                }
-                else if (ch == 1)
-                {
-                    temp = get_pixel(intensity_y, i, j, 0) * get_pixel(intensity_y, i, j, 0);
-                }
-
-                else if (ch == 2)
-                {
-                    temp = get_pixel(intensity_x, i, j, 0) * get_pixel(intensity_y, i, j, 0);
-                }
-
-                else if (ch == 3)
-                {
-                    temp = get_pixel(intensity_x, i, j, 0) * get_pixel(time_gradients, i, j, 0);
-                }
-                else
-                {
-                    temp = get_pixel(intensity_y, i, j, 0) * get_pixel(time_gradients, i, j, 0);
-                }
-
-                set_pixel(S, i, j, ch, temp);
-            }
-        }
-    }
+    time_structure_job job = {intensity_x, intensity_y, time_gradients, S};
+    parallel_for(S.w * S.h, 4096, time_structure_products, &job);
+    free_image(sobel_x_filter);
+    free_image(sobel_y_filter);
+    free_image(intensity_x);
+    free_image(intensity_y);
+    free_image(time_gradients);
 
     if (converted)
     {
@@ -206,8 +203,9 @@ image time_structure_matrix(image im, image prev, int s)
 
     float sigma = s / 6; // rule of thumb
 
-    S = smooth_image(S, sigma, 1);
-    return S;
+    image smoothed = smooth_image(S, sigma, 1);
+    free_image(S);
+    return smoothed;
 }
 
 // Calculate the velocity given a structure image
@@ -246,16 +244,20 @@ image velocity_image(image S, int stride)
             p.data[0][0] = -Ixt;
             p.data[1][0] = -Iyt;
 
-            matrix solution = matrix_mult_matrix(matrix_invert(M), p);
+            matrix Minv = matrix_invert(M);
+            matrix solution = matrix_mult_matrix(Minv, p);
 
             float vx = solution.data[0][0];
             float vy = solution.data[1][0];
+            free_matrix(Minv);
+            free_matrix(solution);
 
             set_pixel(v, 0, j / stride, i / stride, vx);
             set_pixel(v, 1, j / stride, i / stride, vy);
         }
     }
     free_matrix(M);
+    free_matrix(p);
     return v;
 }
 
@@ -3,9 +3,12 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <float.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
 #include <time.h>
+#include <pthread.h>
 
 #define INVALID_CORNER -999999
 
@@ -22,33 +25,95 @@ void free_descriptors(descriptor *d, int n)
     free(d);
 }
 
-// Create a feature descriptor for an index in an image.
-// image im: source image.
-// int i: index in image for the pixel we want to describe.
-// returns: descriptor for that index.
-descriptor describe_index(image im, int i)
+// Describes the pixel at (x, y) of a strided image or view by its 5x5
+// neighbourhood into out, 25 * im.c floats. Taps outside it are clamped to
+// its edges, like get_pixel.
+static void describe_into(strided_image im, int x, int y, float *out)
 {
     int w = 5;
-    descriptor d;
-    d.p.x = i % im.w;
-    d.p.y = i / im.w;
-    d.data = calloc(w * w * im.c, sizeof(float));
-    d.n = w * w * im.c;
     int c, dx, dy;
     int count = 0;
 
     for (c = 0; c < im.c; ++c)
     {
-        float cval = im.data[c * im.w * im.h + i];
+        float cval = strided_row(im, c, y)[x];
         for (dx = -w / 2; dx < (w + 1) / 2; ++dx)
         {
+            int sx = MIN(MAX(x + dx, 0), im.w - 1);
             for (dy = -w / 2; dy < (w + 1) / 2; ++dy)
             {
-                float val = get_pixel(im, i % im.w + dx, i / im.w + dy, c);
-                d.data[count++] = cval - val;
+                int sy = MIN(MAX(y + dy, 0), im.h - 1);
+                float val = strided_row(im, c, sy)[sx];
+                out[count++] = cval - val;
             }
         }
     }
+}
+
+static descriptor describe_strided(strided_image im, int x, int y)
+{
+    descriptor d;
+    d.p.x = x;
+    d.p.y = y;
+    d.n = 25 * im.c;
+    d.data = calloc(d.n, sizeof(float));
+    describe_into(im, x, y, d.data);
+    return d;
+}
+
+// Create a feature descriptor for an index in an image.
+// image im: source image.
+// int i: index in image for the pixel we want to describe.
+// returns: descriptor for that index.
+descriptor describe_index(image im, int i)
+{
+    return describe_strided(image_as_strided(im), i % im.w, i / im.w);
+}
+
+// Makes a set of n zeroed descriptors of dim floats each.
+descriptor_set make_descriptor_set(int n, int dim)
+{
+    descriptor_set s;
+    s.n = n;
+    s.dim = dim;
+    s.x = calloc(2 * (size_t)n + 1, sizeof(float));
+    s.y = s.x + n;
+    s.rows = make_strided_image(dim, n, 1);
+    return s;
+}
+
+void free_descriptor_set(descriptor_set s)
+{
+    free(s.x);
+    free_strided_image(s.rows);
+}
+
+// Copies an array of descriptors, which must all be the same length, into a
+// new set.
+descriptor_set descriptors_to_set(descriptor *d, int n)
+{
+    descriptor_set s = make_descriptor_set(n, n ? d[0].n : 0);
+    for (int i = 0; i < n; ++i)
+    {
+        assert(d[i].n == s.dim);
+        s.x[i] = d[i].p.x;
+        s.y[i] = d[i].p.y;
+        memcpy(strided_row(s.rows, 0, i), d[i].data, s.dim * sizeof(float));
+    }
+    return s;
+}
+
+// Copies a set out into an array of descriptors for free_descriptors.
+descriptor *descriptor_set_to_array(descriptor_set s)
+{
+    descriptor *d = calloc(s.n, sizeof(descriptor));
+    for (int i = 0; i < s.n; ++i)
+    {
+        d[i].p = make_point(s.x[i], s.y[i]);
+        d[i].n = s.dim;
+        d[i].data = calloc(s.dim, sizeof(float));
+        memcpy(d[i].data, strided_row(s.rows, 0, i), s.dim * sizeof(float));
+    }
     return d;
 }
 
@@ -84,6 +149,15 @@ void mark_corners(image im, descriptor *d, int n)
     }
 }
 
+// Marks the spot of every descriptor in a set.
+void mark_descriptor_set(image im, descriptor_set s)
+{
+    for (int i = 0; i < s.n; ++i)
+    {
+        mark_spot(im, make_point(s.x[i], s.y[i]));
+    }
+}
+
 // Creates a 1d Gaussian filter.
 // float sigma: standard deviation of Gaussian.
 // row: defines whether we want row (1 x N) or column (N x 1)
@@ -122,15 +196,177 @@ image make_1d_gaussian(float sigma, int row)
     return gauss_1d;
 }
 
-// Smooths an image using separable Gaussian filter.
+// Young-van Vliet recursive Gaussian: a causal then an anti-causal 3rd order
+// IIR filter, y[n] = B x[n] + a1 y[n-1] + a2 y[n-2] + a3 y[n-3], whose cost per
+// pixel does not depend on sigma.
+typedef struct
+{
+    float B, a1, a2, a3;
+    float M[3][3]; // maps the last causal outputs to the anti-causal start state
+} recursive_gaussian;
+
+// Computes the filter coefficients for a given sigma (valid for sigma >= .5).
+// Borders are clamped like get_pixel. The causal pass starts in the steady
+// state of the first pixel; the anti-causal pass must start from the state it
+// would reach after the last pixel repeated forever. That state is linear in
+// the last three causal outputs (Triggs-Sdika), so M is found once by running
+// both passes on the three unit impulses.
+static recursive_gaussian make_recursive_gaussian(float sigma)
+{
+    recursive_gaussian g;
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double a1 = (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0;
+    double a2 = -(1.4281 * q * q + 1.26661 * q * q * q) / b0;
+    double a3 = 0.422205 * q * q * q / b0;
+    double B = 1 - (a1 + a2 + a3);
+    g.B = B;
+    g.a1 = a1;
+    g.a2 = a2;
+    g.a3 = a3;
+
+    int n = (int)(40 * sigma) + 100; // long enough for the impulse response to die out
+    double *fwd = calloc(n + 6, sizeof(double));
+    double *bwd = calloc(n + 6, sizeof(double));
+    for (int k = 0; k < 3; ++k)
+    {
+        memset(fwd, 0, (n + 6) * sizeof(double));
+        memset(bwd, 0, (n + 6) * sizeof(double));
+        fwd[2 - k] = 1; // fwd[0..2] hold the last three causal outputs
+        for (int t = 3; t < n + 3; ++t)
+            fwd[t] = a1 * fwd[t - 1] + a2 * fwd[t - 2] + a3 * fwd[t - 3];
+        for (int t = n + 2; t >= 3; --t)
+            bwd[t] = B * fwd[t] + a1 * bwd[t + 1] + a2 * bwd[t + 2] + a3 * bwd[t + 3];
+        for (int i = 0; i < 3; ++i)
+            g.M[i][k] = bwd[3 + i];
+    }
+    free(fwd);
+    free(bwd);
+    return g;
+}
+
+// One plane being smoothed in place, shared by the threads working on it.
+typedef struct
+{
+    recursive_gaussian g;
+    float *plane;
+    int w, h, stride; // stride: floats between the starts of two rows
+} recursive_job;
+
+// Runs the recursive Gaussian along rows [j0, j1) of a plane, in place.
+static void recursive_gaussian_rows(void *ctx, int j0, int j1)
+{
+    recursive_job *job = ctx;
+    recursive_gaussian g = job->g;
+    int w = job->w;
+    float *buf = calloc(w + 6, sizeof(float));
+    float *y = buf + 3;
+    for (int j = j0; j < j1; ++j)
+    {
+        float *x = job->plane + (long)j * job->stride;
+        y[-1] = y[-2] = y[-3] = x[0];
+        for (int i = 0; i < w; ++i)
+            y[i] = g.B * x[i] + g.a1 * y[i - 1] + g.a2 * y[i - 2] + g.a3 * y[i - 3];
+
+        float edge = x[w - 1];
+        float u0 = y[w - 1] - edge, u1 = y[w - 2] - edge, u2 = y[w - 3] - edge;
+        for (int k = 0; k < 3; ++k)
+            y[w + k] = edge + g.M[k][0] * u0 + g.M[k][1] * u1 + g.M[k][2] * u2;
+        for (int i = w - 1; i >= 0; --i)
+            y[i] = g.B * y[i] + g.a1 * y[i + 1] + g.a2 * y[i + 2] + g.a3 * y[i + 3];
+        memcpy(x, y, w * sizeof(float));
+    }
+    free(buf);
+}
+
+// Row j of a column slice, extended by the 3 halo rows kept above and below.
+// float *col: first pixel of the slice, rows stride apart; the halo rows are
+//             n wide.
+static float *halo_row(float *col, float *halo, int stride, int n, int h, int j)
+{
+    if (j < 0)
+        return halo + (-j - 1) * n;
+    if (j >= h)
+        return halo + (3 + j - h) * n;
+    return col + (long)j * stride;
+}
+
+// Runs the recursive Gaussian down columns [x0, x1) of a plane, in place.
+// The recursion steps over row segments, so the inner loops are contiguous.
+static void recursive_gaussian_cols(void *ctx, int x0, int x1)
+{
+    recursive_job *job = ctx;
+    recursive_gaussian g = job->g;
+    int stride = job->stride, h = job->h, n = x1 - x0;
+    float *col = job->plane + x0;
+    float *halo = calloc(7 * n, sizeof(float));
+    float *edge = halo + 6 * n;
+    float *rows[3];
+
+    for (int k = 0; k < 3; ++k)
+        memcpy(halo + k * n, col, n * sizeof(float));
+    memcpy(edge, col + (long)(h - 1) * stride, n * sizeof(float));
+
+    for (int j = 0; j < h; ++j)
+    {
+        float *r = col + (long)j * stride;
+        for (int k = 0; k < 3; ++k)
+            rows[k] = halo_row(col, halo, stride, n, h, j - 1 - k);
+        for (int i = 0; i < n; ++i)
+            r[i] = g.B * r[i] + g.a1 * rows[0][i] + g.a2 * rows[1][i] + g.a3 * rows[2][i];
+    }
+
+    float *last[3];
+    for (int k = 0; k < 3; ++k)
+        last[k] = halo_row(col, halo, stride, n, h, h - 1 - k);
+    for (int k = 0; k < 3; ++k)
+    {
+        float *r = halo + (3 + k) * n;
+        for (int i = 0; i < n; ++i)
+            r[i] = edge[i] + g.M[k][0] * (last[0][i] - edge[i]) + g.M[k][1] * (last[1][i] - edge[i]) + g.M[k][2] * (last[2][i] - edge[i]);
+    }
+
+    for (int j = h - 1; j >= 0; --j)
+    {
+        float *r = col + (long)j * stride;
+        for (int k = 0; k < 3; ++k)
+            rows[k] = halo_row(col, halo, stride, n, h, j + 1 + k);
+        for (int i = 0; i < n; ++i)
+            r[i] = g.B * r[i] + g.a1 * rows[0][i] + g.a2 * rows[1][i] + g.a3 * rows[2][i];
+    }
+    free(halo);
+}
+
+// Runs the recursive Gaussian over every channel of s, in place.
+static void recursive_gaussian_image(strided_image s, float sigma)
+{
+    recursive_gaussian g = make_recursive_gaussian(sigma);
+    for (int ch = 0; ch < s.c; ++ch)
+    {
+        recursive_job job = {g, strided_row(s, ch, 0), s.w, s.h, s.stride};
+        parallel_for(s.h, 8, recursive_gaussian_rows, &job);
+        parallel_for(s.w, 64, recursive_gaussian_cols, &job);
+    }
+}
+
+// Smooths an image using a Gaussian filter.
 // image im: image to smooth.
 // float sigma: std dev. for Gaussian.
+// int use_1d_gauss: 0 convolves with the full 2-D kernel, 1 with two 1-D
+//                   kernels, 2 runs a recursive (IIR) Gaussian whose cost does
+//                   not grow with sigma. Falls back to 1 for sigma < .5.
 // returns: smoothed image.
 image smooth_image(image im, float sigma, int use_1d_gauss)
 {
 
-    assert(use_1d_gauss == 1 || use_1d_gauss == 0);
-    if (!use_1d_gauss)
+    assert(use_1d_gauss >= 0 && use_1d_gauss <= 2);
+    if (use_1d_gauss == 2 && sigma >= .5)
+    {
+        image s = copy_image(im);
+        recursive_gaussian_image(image_as_strided(s), sigma);
+        return s;
+    }
+    else if (!use_1d_gauss)
     {
         image g = make_gaussian_filter(sigma);
         image s = convolve_image(im, g, 1);
@@ -152,53 +388,122 @@ image smooth_image(image im, float sigma, int use_1d_gauss)
     }
 }
 
+// Same as smooth_image on a strided image; the result is a new padded,
+// aligned strided image.
+strided_image smooth_strided_image(strided_image im, float sigma, int use_1d_gauss)
+{
+    assert(use_1d_gauss >= 0 && use_1d_gauss <= 2);
+    if (use_1d_gauss == 2 && sigma >= .5)
+    {
+        strided_image s = make_strided_image(im.w, im.h, im.c);
+        for (int ch = 0; ch < im.c; ++ch)
+        {
+            for (int y = 0; y < im.h; ++y)
+                memcpy(strided_row(s, ch, y), strided_row(im, ch, y), im.w * sizeof(float));
+        }
+        recursive_gaussian_image(s, sigma);
+        return s;
+    }
+    else if (!use_1d_gauss)
+    {
+        image g = make_gaussian_filter(sigma);
+        strided_image s = convolve_strided_image(im, g, 1);
+        free_image(g);
+        return s;
+    }
+    image g_row = make_1d_gaussian(sigma, 1);
+    image g_col = make_1d_gaussian(sigma, 0);
+    strided_image interm = convolve_strided_image(im, g_row, 1);
+    strided_image final = convolve_strided_image(interm, g_col, 1);
+    free_image(g_row);
+    free_image(g_col);
+    free_strided_image(interm);
+    return final;
+}
+
+// Luminance image and the structure matrix built from it, shared by the
+// threads filling it in.
+typedef struct
+{
+    strided_image gray;
+    image S;
+} structure_job;
+
+// Takes the Sobel gradients of rows [j0, j1) and writes Ix^2, Iy^2 and IxIy
+// straight from them, so Ix and Iy never exist as full images.
+static void structure_products(void *ctx, int j0, int j1)
+{
+    structure_job *job = ctx;
+    int w = job->S.w, plane = job->S.w * job->S.h;
+    float *ix = malloc(2 * w * sizeof(float)), *iy = ix + w;
+    for (int j = j0; j < j1; ++j)
+    {
+        sobel_gradient_row(job->gray, j, ix, iy);
+        float *S = job->S.data + j * w;
+        for (int i = 0; i < w; ++i)
+        {
+            S[i] = ix[i] * ix[i];
+            S[plane + i] = iy[i] * iy[i];
+            S[2 * plane + i] = ix[i] * iy[i];
+        }
+    }
+    free(ix);
+}
+
 // Calculate the structure matrix of an image.
 // image im: the input image.
 // float sigma: std dev. to use for weighted sum.
 // returns: structure matrix. 1st channel is Ix^2, 2nd channel is Iy^2,
 //          third channel is IxIy.
 image structure_matrix(image im, float sigma)
+{
+    return structure_matrix_strided(image_as_strided(im), sigma);
+}
+
+// Same as structure_matrix for a strided image or a view into a larger one;
+// borders are those of the view. The result is a packed image.
+image structure_matrix_strided(strided_image im, float sigma)
 {
 
     assert(im.c == 3 || im.c == 1);
     image S = make_image(im.w, im.h, 3);
-    image sobel_x_filter = make_gx_filter();
-    image sobel_y_filter = make_gy_filter();
 
-    image intensity_x = rgb_to_grayscale(convolve_image(im, sobel_x_filter, 1)); // taking to grayscale since we need single channel to calculate required intensity values
-    image intensity_y = rgb_to_grayscale(convolve_image(im, sobel_y_filter, 1)); // same
+    // Sobel and grayscale are both linear, so taking luminance first gives
+    // the same gradients as filtering every channel, at a third of the cost.
+    structure_job job = {im.c == 3 ? rgb_to_grayscale_strided(im) : im, S};
+    parallel_for(S.h, 16, structure_products, &job);
+    if (im.c == 3)
+        free_strided_image(job.gray);
 
-    float temp;
+    image smoothed = smooth_image(S, sigma, 1); // the summation from the equation, all three products at once
+    free_image(S);
 
-    for (int i = 0; i < S.w; ++i)
-    {
-        for (int j = 0; j < S.h; ++j)
-        {
-            for (int ch = 0; ch < S.c; ++ch)
-            {
+    return smoothed;
+}
 
-                if (ch == 0)
-                {
-                    temp = get_pixel(intensity_x, i, j, 0) * get_pixel(intensity_x, i, j, 0);
-                }
-
-                else if (ch == 1)
-                {
-                    temp = get_pixel(intensity_y, i, j, 0) * get_pixel(intensity_y, i, j, 0);
-                }
-
-                else
-                {
-                    temp = get_pixel(intensity_x, i, j, 0) * get_pixel(intensity_y, i, j, 0);
-                }
-                set_pixel(S, i, j, ch, temp);
-            }
-        }
-    }
+// A structure matrix and its response map, shared by the threads filling it.
+typedef struct
+{
+    image S, R;
+} cornerness_job;
 
-    S = smooth_image(S, sigma, 1); // the summation from the equation
+static void cornerness_pixels(void *ctx, int start, int end)
+{
+    float ALPHA = 0.06; // i wont make this tunable. go cry.
+    cornerness_job *job = ctx;
+    int plane = job->S.w * job->S.h;
+    const float *S = job->S.data;
+    float *R = job->R.data;
 
-    return S;
+    for (int i = start; i < end; ++i)
+    {
+        float Ix_sq = S[i];
+        float Iy_sq = S[plane + i];
+        float IxIy = S[2 * plane + i];
+        float det = Ix_sq * Iy_sq - IxIy * IxIy;
+        float trace = Ix_sq + Iy_sq;
+        R[i] = det - ALPHA * trace * trace;
+    }
 }
 
 // Estimate the cornerness of each pixel given a structure matrix S (based on eigen values. here we basically approximate them using equation det(S) - alpha * trace(S)^2, alpha = .06.).
@@ -206,54 +511,145 @@ image structure_matrix(image im, float sigma)
 // returns: a response map of cornerness calculations.
 image cornerness_response(image S)
 {
-    float ALPHA = 0.06; // i wont make this tunable. go cry.
     image R = make_image(S.w, S.h, 1);
+    cornerness_job job = {S, R};
+    parallel_for(S.w * S.h, 4096, cornerness_pixels, &job);
+    return R;
+}
+
+// Running max over windows of k = 2r+1 samples (van Herk / Gil-Werman). The
+// padded line is cut into blocks of k; g holds maxima from the start of each
+// block and h maxima to its end. Any window spans at most two blocks, so its
+// max is max(h[x], g[x + 2r]) whatever the radius. Samples outside the image
+// are -FLT_MAX so windows are clipped at the borders.
+typedef struct
+{
+    image src, dst;
+    float *g, *h;
+    int r, k, len;
+} running_max_job;
+
+// Number of padded samples for a line of n: at least n + 2r, in whole blocks.
+static int running_max_length(int n, int r)
+{
+    int k = 2 * r + 1;
+    return (n + 2 * r + k - 1) / k * k;
+}
+
+// Horizontal pass, one row at a time with per-chunk line buffers.
+static void running_max_rows(void *ctx, int y0, int y1)
+{
+    running_max_job *job = ctx;
+    int w = job->src.w, r = job->r, k = job->k, len = job->len;
+    float *line = malloc(3 * len * sizeof(float)), *g = line + len, *h = g + len;
 
-    for (int i = 0; i < S.w; ++i)
+    for (int y = y0; y < y1; ++y)
     {
-        for (int j = 0; j < S.h; ++j)
+        const float *src = job->src.data + y * w;
+        for (int p = 0; p < r; ++p)
+            line[p] = -FLT_MAX;
+        memcpy(line + r, src, w * sizeof(float));
+        for (int p = w + r; p < len; ++p)
+            line[p] = -FLT_MAX;
+        for (int b = 0; b < len; b += k)
         {
+            g[b] = line[b];
+            for (int p = b + 1; p < b + k; ++p)
+                g[p] = MAX(g[p - 1], line[p]);
+            h[b + k - 1] = line[b + k - 1];
+            for (int p = b + k - 2; p >= b; --p)
+                h[p] = MAX(h[p + 1], line[p]);
+        }
+        float *dst = job->dst.data + y * w;
+        for (int x = 0; x < w; ++x)
+            dst[x] = MAX(h[x], g[x + 2 * r]);
+    }
+    free(line);
+}
 
-            float Ix_sq = get_pixel(S, i, j, 0);
-            float Iy_sq = get_pixel(S, i, j, 1);
-            float IxIy = get_pixel(S, i, j, 2);
-            float det = Ix_sq * Iy_sq - IxIy * IxIy;
-            float trace = Ix_sq + Iy_sq;
-            float result = det - ALPHA * trace * trace;
+// Vertical pass, first step: g and h for whole padded rows, one block of k
+// rows per index, with the inner loop running along the row.
+static void running_max_col_blocks(void *ctx, int b0, int b1)
+{
+    running_max_job *job = ctx;
+    int w = job->src.w, ht = job->src.h, r = job->r, k = job->k;
+    float *pad = malloc(w * sizeof(float));
+    for (int x = 0; x < w; ++x)
+        pad[x] = -FLT_MAX;
 
-            set_pixel(R, i, j, 0, result);
+    for (int b = b0 * k; b < b1 * k; b += k)
+    {
+        for (int p = b; p < b + k; ++p)
+        {
+            const float *src = p - r >= 0 && p - r < ht ? job->src.data + (p - r) * w : pad;
+            float *g = job->g + (long)p * w;
+            if (p == b)
+                memcpy(g, src, w * sizeof(float));
+            else
+                for (int x = 0; x < w; ++x)
+                    g[x] = MAX(g[x - w], src[x]);
+        }
+        for (int p = b + k - 1; p >= b; --p)
+        {
+            const float *src = p - r >= 0 && p - r < ht ? job->src.data + (p - r) * w : pad;
+            float *h = job->h + (long)p * w;
+            if (p == b + k - 1)
+                memcpy(h, src, w * sizeof(float));
+            else
+                for (int x = 0; x < w; ++x)
+                    h[x] = MAX(h[x + w], src[x]);
         }
     }
-    return R;
+    free(pad);
 }
 
-int checkNeighbourPixels(image im, int i, int j, int w)
+static void running_max_col_rows(void *ctx, int y0, int y1)
 {
+    running_max_job *job = ctx;
+    int w = job->src.w, r = job->r;
+    for (int y = y0; y < y1; ++y)
+    {
+        const float *h = job->h + (long)y * w, *g = job->g + (long)(y + 2 * r) * w;
+        float *dst = job->dst.data + y * w;
+        for (int x = 0; x < w; ++x)
+            dst[x] = MAX(h[x], g[x]);
+    }
+}
 
-    float center = get_pixel(im, i, j, 0);
+// Max over the (2r+1)x(2r+1) window around every pixel, clipped to the image,
+// as a horizontal then a vertical running max.
+static image max_filter(image im, int r)
+{
+    image tmp = make_image(im.w, im.h, 1);
+    running_max_job job = {im, tmp, 0, 0, r, 2 * r + 1, running_max_length(im.w, r)};
+    parallel_for(im.h, 16, running_max_rows, &job);
 
-    for (int k = i - w; k <= i + w; ++k)
-    {
-        for (int l = j - w; l <= j + w; ++l)
-        {
+    image out = make_image(im.w, im.h, 1);
+    int len = running_max_length(im.h, r);
+    image g = make_image(im.w, len, 1), h = make_image(im.w, len, 1);
+    running_max_job cols = {tmp, out, g.data, h.data, r, 2 * r + 1, len};
+    parallel_for(len / cols.k, 1, running_max_col_blocks, &cols);
+    parallel_for(im.h, 16, running_max_col_rows, &cols);
 
-            if (k < 0 || k >= im.w || l < 0 || l >= im.h)
-            {
-                continue;
-            }
+    free_image(tmp);
+    free_image(g);
+    free_image(h);
+    return out;
+}
 
-            if (k == i && l == j)
-            {
-                continue;
-            }
+typedef struct
+{
+    image im, max, r;
+} nms_job;
 
-            if (get_pixel(im, k, l, 0) > center)
-            {
-                return INVALID_CORNER;
-            }
-        }
+static void nms_pixels(void *ctx, int start, int end)
+{
+    nms_job *job = ctx;
+    for (int i = start; i < end; ++i)
+    {
+        float v = job->im.data[i];
+        job->r.data[i] = job->max.data[i] > v ? INVALID_CORNER : v;
     }
-    return 1;
 }
 
 // Perform non-max supression on an image of feature responses.
@@ -262,51 +658,148 @@ int checkNeighbourPixels(image im, int i, int j, int w)
 // returns: image with only local-maxima responses within w pixels.
 image nms_image(image im, int w)
 {
-    image r = copy_image(im);
+    if (w <= 0)
+        return copy_image(im);
 
-    for (int i = 0; i < im.w; ++i)
+    // A pixel survives unless something in its window is strictly larger, so
+    // comparing it with the window max (which includes the pixel itself) is
+    // exact, ties included, and costs the same for every radius.
+    image max = max_filter(im, w);
+    image r = make_image(im.w, im.h, 1);
+    nms_job job = {im, max, r};
+    parallel_for(im.w * im.h, 4096, nms_pixels, &job);
+    free_image(max);
+    return r;
+}
+
+// A surviving response and where it is; order is its position in the
+// column-major scan the corners are described in.
+typedef struct
+{
+    float v;
+    int order;
+} corner_candidate;
+
+// Whether a ranks above b: stronger response first, earlier in the scan on ties.
+static int corner_above(corner_candidate a, corner_candidate b)
+{
+    return a.v > b.v || (a.v == b.v && a.order < b.order);
+}
+
+// Offers c to a min-heap that keeps the best cap candidates seen so far.
+static void corner_heap_offer(corner_candidate *heap, int *n, int cap, corner_candidate c)
+{
+    int i;
+    if (*n < cap)
     {
-        for (int j = 0; j < im.h; ++j)
+        i = (*n)++;
+        while (i > 0 && corner_above(heap[(i - 1) / 2], c))
         {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = c;
+        return;
+    }
+    if (!corner_above(c, heap[0]))
+        return;
+    i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= cap)
+            break;
+        if (child + 1 < cap && corner_above(heap[child], heap[child + 1]))
+            ++child;
+        if (!corner_above(c, heap[child]))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = c;
+}
+
+static int compare_corner_order(const void *a, const void *b)
+{
+    return ((const corner_candidate *)a)->order - ((const corner_candidate *)b)->order;
+}
 
-            int response = checkNeighbourPixels(im, i, j, w);
+// Picks which responses left by NMS become corners.
+// image Rnms: response map with suppressed pixels set to INVALID_CORNER.
+// int max_features: most corners to keep, 0 or less for all of them.
+// int *n: filled with the number of corners picked.
+// returns: the corners in column-major scan order.
+static corner_candidate *select_corners(image Rnms, int max_features, int *n)
+{
+    int total = 0;
+    for (int i = 0; i < Rnms.w * Rnms.h; ++i)
+        total += Rnms.data[i] != INVALID_CORNER;
 
-            if (response != 1)
+    if (max_features <= 0 || max_features >= total)
+    {
+        corner_candidate *all = calloc(total, sizeof(corner_candidate));
+        *n = 0;
+        for (int i = 0; i < Rnms.w; ++i)
+        {
+            for (int j = 0; j < Rnms.h; ++j)
             {
-                set_pixel(r, i, j, 0, response);
+                float v = Rnms.data[j * Rnms.w + i];
+                if (v != INVALID_CORNER)
+                    all[(*n)++] = (corner_candidate){v, i * Rnms.h + j};
             }
         }
+        return all;
     }
-    return r;
-}
 
-int countResponses(image rNMS)
-{
-    int num_corners = 0;
+    // Grid of about max_features / 8 square-ish cells. Each cell keeps its
+    // best 2 * max_features / cells, so cells with little texture hand their
+    // share to busier ones, and a final heap keeps the best max_features.
+    int want = MAX(1, max_features / 8);
+    int cols = MAX(1, (int)ceilf(sqrtf((float)want * Rnms.w / Rnms.h)));
+    int rows = MAX(1, (want + cols - 1) / cols);
+    int cells = cols * rows;
+    int quota = (2 * max_features + cells - 1) / cells;
 
-    for (int i = 0; i < rNMS.w; ++i)
+    corner_candidate *cell_heaps = calloc((long)cells * quota, sizeof(corner_candidate));
+    int *cell_n = calloc(cells, sizeof(int));
+    for (int i = 0; i < Rnms.w; ++i)
     {
-        for (int j = 0; j < rNMS.h; ++j)
+        int cx = (long)i * cols / Rnms.w;
+        for (int j = 0; j < Rnms.h; ++j)
         {
-            if (get_pixel(rNMS, i, j, 0) != INVALID_CORNER)
-                ++num_corners;
+            float v = Rnms.data[j * Rnms.w + i];
+            if (v == INVALID_CORNER)
+                continue;
+            int cell = (long)j * rows / Rnms.h * cols + cx;
+            corner_heap_offer(cell_heaps + (long)cell * quota, cell_n + cell, quota,
+                              (corner_candidate){v, i * Rnms.h + j});
         }
     }
 
-    return num_corners;
+    corner_candidate *best = calloc(max_features, sizeof(corner_candidate));
+    *n = 0;
+    for (int cell = 0; cell < cells; ++cell)
+    {
+        for (int k = 0; k < cell_n[cell]; ++k)
+            corner_heap_offer(best, n, max_features, cell_heaps[(long)cell * quota + k]);
+    }
+    free(cell_heaps);
+    free(cell_n);
+
+    qsort(best, *n, sizeof(corner_candidate), compare_corner_order);
+    return best;
 }
 
-// Perform harris corner detection and extract features from the corners.
-// image im: input image.
-// float sigma: std. dev for harris.
-// float thresh: threshold for cornerness.
-// int nms: distance to look for local-maxes in response map.
-// int *n: pointer to number of corners detected, should fill in.
-// returns: array of descriptors of the corners in the image.
-descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
+// The corner-finding half of harris_corner_detector: response, threshold,
+// NMS and the max-features cap.
+// const panorama_options *opt: null for the defaults.
+// returns: the corners in column-major scan order; order / im.h is x and
+//          order % im.h is y.
+static corner_candidate *find_harris_corners(strided_image im, float sigma, float thresh, int nms,
+                                             const panorama_options *opt, int *n)
 {
 
-    image S = structure_matrix(im, sigma); // done.
+    image S = structure_matrix_strided(im, sigma); // done.
 
     image R = cornerness_response(S); // done. actually here we are supposed to calculate eigen values but we have settled with their approximations instead
 
@@ -318,7 +811,6 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
             max_cornerness = R.data[i];
         }
     }
-    printf("Max cornerness before thresholding: %f\n", max_cornerness);
     thresh = 0.01 * max_cornerness;
 
     for (int i = 0; i < R.w; ++i)
@@ -332,34 +824,269 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
             }
         }
     }
-    save_image(R, "cornerness_raw_after_low_marked");
 
     image Rnms = nms_image(R, nms); // done
-    save_image(Rnms, "cornerness_nms");
 
-    int count = countResponses(Rnms);
+    corner_candidate *corners = select_corners(Rnms, opt ? opt->max_features : 0, n);
 
-    *n = count;
-    descriptor *d = calloc(count, sizeof(descriptor));
+    free_image(S);
+    free_image(R);
+    free_image(Rnms);
+    return corners;
+}
 
-    int idx_desc = 0;
-    for (int i = 0; i < Rnms.w; ++i)
+// Perform harris corner detection and extract features from the corners.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// int *n: pointer to number of corners detected, should fill in.
+// returns: array of descriptors of the corners in the image.
+descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
+{
+    return harris_corner_detector_strided(image_as_strided(im), sigma, thresh, nms, n);
+}
+
+// Same as harris_corner_detector for a strided image or a view into a larger
+// one, so a region of interest can be searched without copying it out.
+// Corner positions are relative to the view.
+descriptor *harris_corner_detector_strided(strided_image im, float sigma, float thresh, int nms, int *n)
+{
+    descriptor_set s = harris_descriptor_set_strided(im, sigma, thresh, nms);
+    descriptor *d = descriptor_set_to_array(s);
+    *n = s.n;
+    free_descriptor_set(s);
+    return d;
+}
+
+// Same as harris_corner_detector, with the descriptors written straight into
+// one descriptor set instead of one allocation each.
+descriptor_set harris_descriptor_set(image im, float sigma, float thresh, int nms)
+{
+    return harris_descriptor_set_strided(image_as_strided(im), sigma, thresh, nms);
+}
+
+// Same as harris_descriptor_set for a strided image or a view.
+descriptor_set harris_descriptor_set_strided(strided_image im, float sigma, float thresh, int nms)
+{
+    return harris_descriptor_set_ex(im, sigma, thresh, nms, 0);
+}
+
+// Same as harris_descriptor_set_strided with the settings in opt; only
+// max_features applies.
+descriptor_set harris_descriptor_set_ex(strided_image im, float sigma, float thresh, int nms,
+                                        const panorama_options *opt)
+{
+    int count = 0;
+    corner_candidate *corners = find_harris_corners(im, sigma, thresh, nms, opt, &count);
+
+    descriptor_set d = make_descriptor_set(count, 25 * im.c);
+    for (int k = 0; k < count; ++k)
     {
-        for (int j = 0; j < Rnms.h; ++j)
+        int x = corners[k].order / im.h, y = corners[k].order % im.h;
+        d.x[k] = x;
+        d.y[k] = y;
+        describe_into(im, x, y, strided_row(d.rows, 0, k));
+    }
+    free(corners);
+    return d;
+}
+
+// Binary descriptors sample a 31x31 patch, as in BRIEF, after smoothing with
+// this sigma so single-pixel noise does not flip bits.
+#define BINARY_PATCH_RADIUS 15
+#define BINARY_SMOOTH_SIGMA 2
+
+// The point pairs binary descriptors compare, drawn once from a fixed seed:
+// both ends roughly Gaussian around the corner with a std. dev. of a fifth of
+// the patch, clamped to the patch. Filled under pthread_once so callers on
+// different threads can't race to build it.
+static signed char binary_pattern[BINARY_DESCRIPTOR_WORDS * 64][4];
+static pthread_once_t binary_pattern_once = PTHREAD_ONCE_INIT;
+
+static void make_binary_pattern()
+{
+    unsigned int state = 2024;
+    for (int k = 0; k < BINARY_DESCRIPTOR_WORDS * 64; ++k)
+    {
+        for (int e = 0; e < 4; ++e)
         {
-            if (get_pixel(Rnms, i, j, 0) != INVALID_CORNER)
+            // Sum of four uniforms, scaled to std. dev. 31 / 5.
+            float g = 0;
+            for (int u = 0; u < 4; ++u)
             {
-                d[idx_desc++] = describe_index(im, j * Rnms.w + i);
+                state = state * 1664525u + 1013904223u;
+                g += (state >> 8) / 16777216.0f - .5f;
             }
+            int v = (int)lroundf(g * 6.2f * sqrtf(3.f));
+            binary_pattern[k][e] = MIN(MAX(v, -BINARY_PATCH_RADIUS), BINARY_PATCH_RADIUS);
         }
     }
+}
 
-    free_image(S);
-    free_image(R);
-    free_image(Rnms);
+// Corners to describe and the smoothed luminance they are described from,
+// shared by the threads writing the descriptors.
+typedef struct
+{
+    strided_image smooth;
+    binary_descriptor_set d;
+} binary_job;
+
+static void binary_describe(void *ctx, int k0, int k1)
+{
+    binary_job *job = ctx;
+    strided_image im = job->smooth;
+    for (int k = k0; k < k1; ++k)
+    {
+        int x = job->d.x[k], y = job->d.y[k];
+        uint64_t *bits = job->d.bits + (long)k * BINARY_DESCRIPTOR_WORDS;
+        for (int w = 0; w < BINARY_DESCRIPTOR_WORDS; ++w)
+        {
+            uint64_t word = 0;
+            for (int b = 0; b < 64; ++b)
+            {
+                const signed char *p = binary_pattern[w * 64 + b];
+                int x1 = MIN(MAX(x + p[0], 0), im.w - 1), y1 = MIN(MAX(y + p[1], 0), im.h - 1);
+                int x2 = MIN(MAX(x + p[2], 0), im.w - 1), y2 = MIN(MAX(y + p[3], 0), im.h - 1);
+                word |= (uint64_t)(strided_row(im, 0, y1)[x1] < strided_row(im, 0, y2)[x2]) << b;
+            }
+            bits[w] = word;
+        }
+    }
+}
+
+// Same as harris_descriptor_set, with 256-bit binary descriptors instead of
+// raw patch differences.
+binary_descriptor_set harris_binary_descriptor_set(image im, float sigma, float thresh, int nms)
+{
+    return harris_binary_descriptor_set_strided(image_as_strided(im), sigma, thresh, nms);
+}
+
+// Same as harris_binary_descriptor_set for a strided image or a view.
+binary_descriptor_set harris_binary_descriptor_set_strided(strided_image im, float sigma, float thresh, int nms)
+{
+    return harris_binary_descriptor_set_ex(im, sigma, thresh, nms, 0);
+}
+
+// Same as harris_binary_descriptor_set_strided with the settings in opt; only
+// max_features applies.
+binary_descriptor_set harris_binary_descriptor_set_ex(strided_image im, float sigma, float thresh, int nms,
+                                                      const panorama_options *opt)
+{
+    pthread_once(&binary_pattern_once, make_binary_pattern);
+
+    int count = 0;
+    corner_candidate *corners = find_harris_corners(im, sigma, thresh, nms, opt, &count);
+
+    binary_descriptor_set d;
+    d.n = count;
+    d.x = calloc(2 * (size_t)count + 1, sizeof(float));
+    d.y = d.x + count;
+    d.bits = calloc((size_t)count * BINARY_DESCRIPTOR_WORDS + 1, sizeof(uint64_t));
+    for (int k = 0; k < count; ++k)
+    {
+        d.x[k] = corners[k].order / im.h;
+        d.y[k] = corners[k].order % im.h;
+    }
+    free(corners);
+
+    strided_image gray = im.c == 3 ? rgb_to_grayscale_strided(im) : im;
+    binary_job job = {smooth_strided_image(gray, BINARY_SMOOTH_SIGMA, 1), d};
+    parallel_for(count, 64, binary_describe, &job);
+    free_strided_image(job.smooth);
+    if (im.c == 3)
+        free_strided_image(gray);
+    return d;
+}
+
+void free_binary_descriptor_set(binary_descriptor_set s)
+{
+    free(s.x);
+    free(s.bits);
+}
+
+// Quantizes one descriptor value to its stored byte.
+static inline unsigned char quantize_value(float v)
+{
+    float q = v * QUANTIZED_DESCRIPTOR_SCALE;
+    q = MIN(MAX(q, -QUANTIZED_DESCRIPTOR_SCALE), QUANTIZED_DESCRIPTOR_SCALE);
+    return (unsigned char)((int)lroundf(q) + 128);
+}
+
+// Rows start 64-byte aligned for the SAD kernels.
+static quantized_descriptor_set make_quantized_descriptor_set(int n, int dim)
+{
+    quantized_descriptor_set s;
+    s.n = n;
+    s.dim = dim;
+    s.stride = (dim + 31) / 32 * 32;
+    s.x = calloc(2 * (size_t)n + 1, sizeof(float));
+    s.y = s.x + n;
+    size_t bytes = (size_t)n * s.stride + 64;
+    s.rows = uwimg_aligned_calloc(bytes, 64);
+    memset(s.rows, 128, bytes);
+    return s;
+}
+
+// Quantizes a descriptor set into a new one of signed bytes.
+quantized_descriptor_set quantize_descriptor_set(descriptor_set s)
+{
+    quantized_descriptor_set q = make_quantized_descriptor_set(s.n, s.dim);
+    memcpy(q.x, s.x, s.n * sizeof(float));
+    memcpy(q.y, s.y, s.n * sizeof(float));
+    for (int i = 0; i < s.n; ++i)
+    {
+        const float *row = strided_row(s.rows, 0, i);
+        unsigned char *out = q.rows + (long)i * q.stride;
+        for (int k = 0; k < s.dim; ++k)
+            out[k] = quantize_value(row[k]);
+    }
+    return q;
+}
+
+// Same as harris_descriptor_set, quantizing each descriptor as it is made
+// instead of keeping the floats.
+quantized_descriptor_set harris_quantized_descriptor_set(image im, float sigma, float thresh, int nms)
+{
+    return harris_quantized_descriptor_set_strided(image_as_strided(im), sigma, thresh, nms);
+}
+
+// Same as harris_quantized_descriptor_set for a strided image or a view.
+quantized_descriptor_set harris_quantized_descriptor_set_strided(strided_image im, float sigma, float thresh, int nms)
+{
+    return harris_quantized_descriptor_set_ex(im, sigma, thresh, nms, 0);
+}
+
+// Same as harris_quantized_descriptor_set_strided with the settings in opt;
+// only max_features applies.
+quantized_descriptor_set harris_quantized_descriptor_set_ex(strided_image im, float sigma, float thresh, int nms,
+                                                            const panorama_options *opt)
+{
+    int count = 0;
+    corner_candidate *corners = find_harris_corners(im, sigma, thresh, nms, opt, &count);
+
+    quantized_descriptor_set d = make_quantized_descriptor_set(count, 25 * im.c);
+    float *row = calloc(d.dim, sizeof(float));
+    for (int k = 0; k < count; ++k)
+    {
+        int x = corners[k].order / im.h, y = corners[k].order % im.h;
+        d.x[k] = x;
+        d.y[k] = y;
+        describe_into(im, x, y, row);
+        for (int i = 0; i < d.dim; ++i)
+            d.rows[(long)k * d.stride + i] = quantize_value(row[i]);
+    }
+    free(row);
+    free(corners);
     return d;
 }
 
+void free_quantized_descriptor_set(quantized_descriptor_set s)
+{
+    free(s.x);
+    uwimg_aligned_free(s.rows);
+}
+
 // Find and draw corners on an image.
 // image im: input image.
 // float sigma: std. dev for harris.
@@ -370,4 +1097,5 @@ void detect_and_draw_corners(image im, float sigma, float thresh, int nms)
     int n = 0;
     descriptor *d = harris_corner_detector(im, sigma, thresh, nms, &n);
     mark_corners(im, d, n);
+    free_descriptors(d, n);
 }
@@ -3,6 +3,8 @@
 #include "matrix.h"
 #define TWOPI 6.2831853
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // you dont want to edit anything in this file
 
@@ -25,11 +27,95 @@ extern "C"
         float *data;
     } image;
 
+    // An image whose rows are stride floats apart and whose channel planes
+    // are plane floats apart. make_strided_image pads both so every row starts
+    // on a 64-byte boundary; a packed image is the case stride == w and
+    // plane == w * h. Kept separate from image so the ctypes layout of image
+    // in uwimg.py does not change. A view into a larger image is a strided
+    // image whose data points into its parent (see image_view).
+    typedef struct
+    {
+        int w, h, c;
+        int stride;
+        long plane;
+        float *data;
+    } strided_image;
+
+    // Start of row y of channel c.
+    static inline float *strided_row(strided_image im, int c, int y)
+    {
+        return im.data + c * im.plane + (long)y * im.stride;
+    }
+
+    // What reads outside an image return. Convolution, resize and warps take
+    // one of these; get_pixel itself always clamps.
+    typedef enum
+    {
+        BORDER_CLAMP,   // repeat the edge pixel: aaa|abcd|ddd
+        BORDER_ZERO,    // zeros: 000|abcd|000
+        BORDER_REFLECT, // mirror about the edge pixel: dcb|abcd|cba
+        BORDER_WRAP     // tile the image: bcd|abcd|abc
+    } border_mode;
+
+    // How match_descriptor_sets compares float descriptors.
+    typedef enum
+    {
+        MATCH_L1, // sum of absolute differences
+        MATCH_L2  // Euclidean distance
+    } match_metric;
+
+    // How RANSAC draws its samples of four matches.
+    typedef enum
+    {
+        SAMPLE_UNIFORM, // uniformly from all of them
+        SAMPLE_PROSAC   // from the best-ranked first, widening as it goes
+    } ransac_sampler;
+
+    // Settings for detecting, matching and fitting features, taken by the _ex
+    // functions. Each call gets its own, so threads can use different ones. A
+    // zeroed struct, or a null pointer, gives the defaults the plain functions
+    // use: every setting off.
+    typedef struct
+    {
+        // Most corners to keep, spread over a grid so strong texture in one
+        // area cannot crowd out the rest; 0 keeps every one that survives NMS.
+        int max_features;
+        // Distance checks per query through a KD-forest over b; 0 (or a b with
+        // no more descriptors than checks) searches exhaustively. The forest
+        // searches by L1, so MATCH_L2 is always exhaustive.
+        int ann_checks;
+        match_metric metric;
+        // Drop a match unless its distance is less than this times the one to
+        // the second nearest (Lowe's ratio test, about .8); 0 keeps them all.
+        float match_ratio;
+        // Keep a match only if it is also nearest from b's side. With the
+        // KD-forest this only knows the distances the searches measured.
+        int match_mutual;
+        // SAMPLE_PROSAC expects matches sorted best first, as
+        // match_descriptor_sets returns them.
+        ransac_sampler sampler;
+        // Stop RANSAC once it has drawn an all-inlier sample with this
+        // confidence, given the best inlier ratio so far; 0 runs all k.
+        float ransac_confidence;
+        // Stop scoring a hypothesis once a sequential probability ratio test
+        // says it is bad. The test draws its own random numbers.
+        int ransac_sprt;
+    } panorama_options;
+
     typedef struct
     {
         float x, y;
     } point;
 
+    // Counters kept by the image buffer pool behind make_image/free_image.
+    typedef struct
+    {
+        long allocations; // make_image calls
+        long reused;      // of which were served from the pool
+        long frees;       // free_image calls
+        size_t live_bytes, peak_bytes, pooled_bytes;
+    } image_pool_stats;
+
     typedef struct
     {
         point p;
@@ -44,6 +130,62 @@ extern "C"
         float distance;
     } match;
 
+    // Descriptors of one image kept together, so matching walks one block
+    // instead of chasing a pointer per descriptor. Row i of rows (dim x n,
+    // padded and 64-byte aligned, padding zeroed) is descriptor i, taken at
+    // (x[i], y[i]).
+    typedef struct
+    {
+        int n, dim;
+        float *x, *y;
+        strided_image rows;
+    } descriptor_set;
+
+    // 64-bit words in a binary descriptor: 256 bits.
+#define BINARY_DESCRIPTOR_WORDS 4
+
+    // BRIEF-style binary descriptors of one image: bit k of descriptor i says
+    // whether the smoothed image is darker at the first point of pair k of a
+    // fixed pattern around (x[i], y[i]) than at the second. 32 bytes each
+    // against 25 * c floats for descriptor_set.
+    typedef struct
+    {
+        int n;
+        float *x, *y;
+        uint64_t *bits; // n * BINARY_DESCRIPTOR_WORDS words
+    } binary_descriptor_set;
+
+    // Descriptor values are scaled by this and rounded to signed bytes, so
+    // patch differences in [-1, 1] use the whole int8 range.
+#define QUANTIZED_DESCRIPTOR_SCALE 127
+
+    // descriptor_set with each value quantized to a signed byte and stored
+    // offset by 128, so unsigned sum-of-absolute-differences instructions give
+    // the L1 distance directly. Rows are stride bytes apart (a multiple of 32,
+    // padded with the byte for 0) in a 64-byte aligned block: a quarter of the
+    // float rows.
+    typedef struct
+    {
+        int n, dim, stride;
+        float *x, *y;
+        unsigned char *rows;
+    } quantized_descriptor_set;
+
+    // The nearest two of a block of descriptors to some query.
+    typedef struct
+    {
+        int best;     // row of the nearest, -1 if there were none
+        float d1, d2; // its distance and the second smallest
+    } nearest_two;
+
+    // What a RANSAC_ex call did.
+    typedef struct
+    {
+        int iterations;     // hypotheses drawn
+        long checks;        // matches projected to score them
+        int best_iteration; // the hypothesis returned, 0 for none
+    } ransac_stats;
+
     static point make_point(float x, float y)
     {
         point p;
@@ -53,6 +195,8 @@ extern "C"
     }
 
     float get_pixel(image im, int x, int y, int c);
+    int border_coord(int i, int n, border_mode border);
+    float get_pixel_border(image im, int x, int y, int c, border_mode border);
     void set_pixel(image im, int x, int y, int c, float v);
     image copy_image(image im);
     image rgb_to_grayscale(image im);
@@ -67,21 +211,70 @@ extern "C"
     image sub_image(image a, image b);
     image add_image(image a, image b);
 
+    // threading
+    int uwimg_set_num_threads(int n);
+    int uwimg_get_num_threads();
+
     // loading and saving
     image make_image(int w, int h, int c);
     image load_image(char *filename);
     void save_image(image im, const char *name);
     void save_png(image im, const char *name);
+    image u8_to_image(const unsigned char *data, int w, int h, int c);
+    void image_to_u8(image im, unsigned char *data);
     void free_image(image im);
+    void set_image_pool_limit(size_t bytes);
+    void image_pool_clear();
+    image_pool_stats get_image_pool_stats();
+    void reset_image_pool_stats();
+    void print_image_pool_stats(const char *label);
+
+    // strided images
+    void *uwimg_aligned_calloc(size_t bytes, size_t align);
+    void uwimg_aligned_free(void *p);
+    strided_image make_strided_image(int w, int h, int c);
+    void free_strided_image(strided_image im);
+    strided_image image_as_strided(image im);
+    strided_image to_strided_image(image im);
+    image from_strided_image(strided_image im);
+    strided_image image_view(image im, int x, int y, int w, int h);
+    strided_image strided_view(strided_image im, int x, int y, int w, int h);
+    void paste_strided_image(strided_image dst, strided_image src);
+    strided_image convolve_strided_image(strided_image im, image filter, int preserve);
+    strided_image smooth_strided_image(strided_image im, float sigma, int use_1d_gauss);
+    strided_image rgb_to_grayscale_strided(strided_image im);
+    void rgb_to_hsv_strided(strided_image im);
+    void hsv_to_rgb_strided(strided_image im);
+    strided_image nn_resize_strided(strided_image im, int w, int h);
+    strided_image bilinear_resize_strided(strided_image im, int w, int h);
+    image structure_matrix_strided(strided_image im, float sigma);
+    descriptor *harris_corner_detector_strided(strided_image im, float sigma, float thresh, int nms, int *n);
+    descriptor_set harris_descriptor_set_strided(strided_image im, float sigma, float thresh, int nms);
+    binary_descriptor_set harris_binary_descriptor_set_strided(strided_image im, float sigma, float thresh, int nms);
+    quantized_descriptor_set harris_quantized_descriptor_set_strided(strided_image im, float sigma, float thresh,
+                                                                     int nms);
+    descriptor_set harris_descriptor_set_ex(strided_image im, float sigma, float thresh, int nms,
+                                            const panorama_options *opt);
+    binary_descriptor_set harris_binary_descriptor_set_ex(strided_image im, float sigma, float thresh, int nms,
+                                                          const panorama_options *opt);
+    quantized_descriptor_set harris_quantized_descriptor_set_ex(strided_image im, float sigma, float thresh, int nms,
+                                                                const panorama_options *opt);
 
     // resizing
     float nn_interpolate(image im, float x, float y, int c);
     image nn_resize(image im, int w, int h);
     float bilinear_interpolate(image im, float x, float y, int c);
+    float bilinear_interpolate_border(image im, float x, float y, int c, border_mode border);
     image bilinear_resize(image im, int w, int h);
+    image bilinear_resize_border(image im, int w, int h, border_mode border);
 
     // filtering
     image convolve_image(image im, image filter, int preserve);
+    image convolve_image_direct(image im, image filter, int preserve);
+    image convolve_image_border(image im, image filter, int preserve, border_mode border);
+    void set_fft_convolve_threshold(int size);
+    int get_fft_convolve_threshold();
+    int convolve_uses_fft(image filter);
     image make_box_filter(int w);
     image make_highpass_filter();
     image make_sharpen_filter();
@@ -93,21 +286,54 @@ extern "C"
     void l1_normalize(image im);
     void threshold_image(image im, float thresh);
     image *sobel_image(image im);
+    image *sobel_gradients(image im, int fast);
+    void sobel_gradient_row(strided_image im, int y, float *gx, float *gy);
     image colorize_sobel(image im);
     image smooth_image(image im, float sigma, int use_1d_gauss);
+    image make_1d_gaussian(float sigma, int row);
 
     // panoroma, corner detection
     image structure_matrix(image im, float sigma);
     image cornerness_response(image S);
+    image nms_image(image im, int w);
     void free_descriptors(descriptor *d, int n);
     void mark_corners(image im, descriptor *d, int n);
     image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms);
     void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
     int model_inliers(matrix H, match *m, int n, float thresh);
+    point project_point(matrix H, point p);
+    void randomize_matches(match *m, int n);
+    matrix compute_homography(match *matches, int n);
+    matrix RANSAC(match *m, int n, float thresh, int k, int cutoff);
+    matrix RANSAC_sampler(match *m, int n, float thresh, int k, int cutoff, ransac_sampler sampler);
+    matrix RANSAC_ex(match *m, int n, float thresh, int k, int cutoff, const panorama_options *opt,
+                     ransac_stats *stats);
     image combine_images(image a, image b, matrix H);
+    image warp_image(image im, matrix H, int w, int h, border_mode border);
     match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
     descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
+    descriptor_set make_descriptor_set(int n, int dim);
+    void free_descriptor_set(descriptor_set s);
+    descriptor_set descriptors_to_set(descriptor *d, int n);
+    descriptor *descriptor_set_to_array(descriptor_set s);
+    descriptor_set harris_descriptor_set(image im, float sigma, float thresh, int nms);
+    void mark_descriptor_set(image im, descriptor_set s);
+    binary_descriptor_set harris_binary_descriptor_set(image im, float sigma, float thresh, int nms);
+    void free_binary_descriptor_set(binary_descriptor_set s);
+    match *match_binary_descriptor_sets(binary_descriptor_set a, binary_descriptor_set b, int *mn);
+    quantized_descriptor_set quantize_descriptor_set(descriptor_set s);
+    quantized_descriptor_set harris_quantized_descriptor_set(image im, float sigma, float thresh, int nms);
+    void free_quantized_descriptor_set(quantized_descriptor_set s);
+    match *match_quantized_descriptor_sets(quantized_descriptor_set a, quantized_descriptor_set b, int *mn);
+    match *match_descriptor_sets(descriptor_set a, descriptor_set b, int *mn);
+    match *match_descriptor_sets_ex(descriptor_set a, descriptor_set b, int *mn, const panorama_options *opt);
+    float l1_distance(float *a, float *b, int n);
+    nearest_two l1_nearest_two(const float *q, strided_image rows, int start, int end);
     image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+    image panorama_image_sampler(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters,
+                                 int cutoff, ransac_sampler sampler);
+    image panorama_image_ex(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters,
+                            int cutoff, const panorama_options *opt);
 
     // optical flow
     image make_integral_image(image im);
@@ -1,9 +1,18 @@
 // You probably don't want to edit this file
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "image.h"
 
+// The SSE4.1 and AVX2 kernels below are built whatever -march says and picked
+// at runtime from what the CPU supports.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UWIMG_X86_SIMD
+#include <immintrin.h>
+#endif
+
 image make_empty_image(int w, int h, int c)
 {
     image out;
@@ -14,30 +23,414 @@ image make_empty_image(int w, int h, int c)
     return out;
 }
 
+// Pool of image buffers released by free_image, bucketed by the exact size
+// that was allocated, so pipelines that make and free the same sizes over and
+// over reuse them instead of going back to calloc. Each free buffer stores the
+// next one in its first bytes. Buffers too small to hold that pointer are
+// never pooled.
+#define IMAGE_POOL_BUCKETS 64
+
+typedef struct
+{
+    size_t bytes;
+    void *head;
+} image_pool_bucket;
+
+static struct
+{
+    pthread_mutex_t lock;
+    image_pool_bucket buckets[IMAGE_POOL_BUCKETS];
+    size_t limit;  // most bytes kept in the pool, 0 disables it
+    size_t pooled; // bytes currently kept in the pool
+    image_pool_stats stats;
+} pool = {PTHREAD_MUTEX_INITIALIZER, {{0}}, 256 << 20};
+
+// Finds the bucket for a size, claiming an empty one if there is none yet.
+// returns: 0 if all buckets hold other sizes.
+static image_pool_bucket *find_bucket(size_t bytes, int claim)
+{
+    image_pool_bucket *empty = 0;
+    for (int i = 0; i < IMAGE_POOL_BUCKETS; ++i)
+    {
+        if (pool.buckets[i].bytes == bytes)
+            return &pool.buckets[i];
+        if (!empty && !pool.buckets[i].head)
+            empty = &pool.buckets[i];
+    }
+    if (claim && empty)
+        empty->bytes = bytes;
+    return claim ? empty : 0;
+}
+
+static void *pool_take(size_t bytes)
+{
+    void *data = 0;
+    pthread_mutex_lock(&pool.lock);
+    ++pool.stats.allocations;
+    pool.stats.live_bytes += bytes;
+    pool.stats.peak_bytes = MAX(pool.stats.peak_bytes, pool.stats.live_bytes);
+    image_pool_bucket *b = find_bucket(bytes, 0);
+    if (b && b->head)
+    {
+        data = b->head;
+        b->head = *(void **)data;
+        pool.pooled -= bytes;
+        ++pool.stats.reused;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return data;
+}
+
+// returns: 1 if the pool kept the buffer, 0 if the caller must free it.
+static int pool_give(void *data, size_t bytes)
+{
+    int kept = 0;
+    pthread_mutex_lock(&pool.lock);
+    ++pool.stats.frees;
+    pool.stats.live_bytes -= MIN(bytes, pool.stats.live_bytes);
+    if (bytes >= sizeof(void *) && pool.pooled + bytes <= pool.limit)
+    {
+        image_pool_bucket *b = find_bucket(bytes, 1);
+        if (b)
+        {
+            *(void **)data = b->head;
+            b->head = data;
+            pool.pooled += bytes;
+            kept = 1;
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return kept;
+}
+
+// Frees every buffer held by the pool.
+void image_pool_clear()
+{
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < IMAGE_POOL_BUCKETS; ++i)
+    {
+        while (pool.buckets[i].head)
+        {
+            void *next = *(void **)pool.buckets[i].head;
+            free(pool.buckets[i].head);
+            pool.buckets[i].head = next;
+        }
+        pool.buckets[i].bytes = 0;
+    }
+    pool.pooled = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Sets how many bytes of released image buffers the pool may keep.
+// size_t bytes: the cap, 0 turns pooling off and frees what is held.
+void set_image_pool_limit(size_t bytes)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.limit = bytes;
+    pthread_mutex_unlock(&pool.lock);
+    if (!bytes)
+        image_pool_clear();
+}
+
+image_pool_stats get_image_pool_stats()
+{
+    pthread_mutex_lock(&pool.lock);
+    image_pool_stats stats = pool.stats;
+    stats.pooled_bytes = pool.pooled;
+    pthread_mutex_unlock(&pool.lock);
+    return stats;
+}
+
+// Zeroes the counters and restarts the peak from what is live now, so a
+// following get_image_pool_stats describes a single call.
+void reset_image_pool_stats()
+{
+    pthread_mutex_lock(&pool.lock);
+    size_t live = pool.stats.live_bytes;
+    memset(&pool.stats, 0, sizeof(pool.stats));
+    pool.stats.live_bytes = live;
+    pool.stats.peak_bytes = live;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void print_image_pool_stats(const char *label)
+{
+    image_pool_stats s = get_image_pool_stats();
+    printf("%s: %ld images made (%ld from pool), %ld freed, peak %.1f MB, pool holds %.1f MB\n",
+           label, s.allocations, s.reused, s.frees, s.peak_bytes / 1048576.0, s.pooled_bytes / 1048576.0);
+}
+
+// Rows and planes of strided images start on this many bytes.
+#define STRIDED_ALIGN 64
+
+// Kept just below each block from uwimg_aligned_calloc.
+typedef struct
+{
+    void *raw;    // what was allocated
+    size_t bytes; // how much, which is what the pool files it under
+} aligned_header;
+
+// Allocates a zeroed block of bytes starting on an align-byte boundary, which
+// calloc does not promise past 16 bytes. The block is over-allocated, drawn
+// from the image pool, and frees with uwimg_aligned_free. make_image uses it
+// for every image buffer.
+// size_t align: a power of two.
+void *uwimg_aligned_calloc(size_t bytes, size_t align)
+{
+    size_t total = bytes + align + sizeof(aligned_header);
+    char *raw = pool_take(total);
+    if (raw)
+        memset(raw, 0, total);
+    else
+        raw = calloc(total, 1);
+    char *aligned = raw + sizeof(aligned_header);
+    aligned += (align - (size_t)aligned % align) % align;
+    aligned_header *h = (aligned_header *)aligned - 1;
+    h->raw = raw;
+    h->bytes = total;
+    return aligned;
+}
+
+void uwimg_aligned_free(void *p)
+{
+    if (!p)
+        return;
+    aligned_header *h = (aligned_header *)p - 1;
+    void *raw = h->raw;
+    if (!pool_give(raw, h->bytes))
+        free(raw);
+}
+
+// Makes a zeroed image. The buffer comes from uwimg_aligned_calloc, so the
+// size it was made with travels with it and free_image files it under that
+// size even if the caller has since shrunk c, as load_image_stb does.
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w, h, c);
-    out.data = calloc(h * w * c, sizeof(float));
+    out.data = uwimg_aligned_calloc((size_t)h * w * c * sizeof(float), STRIDED_ALIGN);
     return out;
 }
 
+// Makes a zeroed image whose rows are padded to a multiple of 64 bytes, so
+// every row of every channel plane starts 64-byte aligned. The padding
+// columns stay zero. Free with free_strided_image; the buffer is recycled
+// through the same pool as make_image.
+strided_image make_strided_image(int w, int h, int c)
+{
+    int floats = STRIDED_ALIGN / sizeof(float);
+    strided_image out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.stride = (w + floats - 1) / floats * floats;
+    out.plane = (long)out.stride * h;
+    out.data = uwimg_aligned_calloc((size_t)out.plane * c * sizeof(float), STRIDED_ALIGN);
+    return out;
+}
+
+// Frees an image from make_strided_image or to_strided_image. Views made by
+// image_as_strided own nothing and must not be passed here.
+void free_strided_image(strided_image im)
+{
+    uwimg_aligned_free(im.data);
+}
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(image im, const char *name, int png)
+// Bytes are scaled by this, rather than divided by 255, so the SIMD and
+// scalar paths give the same floats whatever -Ofast does with divisions.
+#define U8_TO_FLOAT (1.0f / 255)
+
+#ifdef UWIMG_X86_SIMD
+// Converts pixels [p, n) of u8_to_planes 4 at a time with SSE4.1: each group
+// is shuffled into per-channel lanes, widened and scaled.
+// returns: the first pixel left for the scalar loop.
+__attribute__((target("sse4.1"))) static int u8_to_planes_sse41(const unsigned char *src, int n, int c, float *dst,
+                                                                 int p)
 {
-    char buff[256];
-    unsigned char *data = calloc(im.w * im.h * im.c, sizeof(char));
-    int i, k;
-    for (k = 0; k < im.c; ++k)
+    const __m128 scale = _mm_set1_ps(U8_TO_FLOAT);
+    // Gathers channel k of 4 pixels into bytes 4k..4k+3.
+    __m128i deinterleave = c == 3 ? _mm_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1)
+                                  : _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    if (c == 1)
     {
-        for (i = 0; i < im.w * im.h; ++i)
+        for (; p + 16 <= n; p += 4)
         {
-            data[i * im.c + k] = (unsigned char)roundf((255 * im.data[i + k * im.w * im.h]));
+            __m128i v = _mm_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(src + p)));
+            _mm_storeu_ps(dst + p, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
         }
     }
+    else if (c == 3 || c == 4)
+    {
+        for (; c * p + 16 <= c * n; p += 4)
+        {
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + c * p)), deinterleave);
+            for (int k = 0; k < c; ++k)
+            {
+                __m128 f = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(v));
+                _mm_storeu_ps(dst + k * n + p, _mm_mul_ps(f, scale));
+                v = _mm_srli_si128(v, 4);
+            }
+        }
+    }
+    return p;
+}
+
+// Same as u8_to_planes_sse41, 8 pixels at a time with AVX2 and then 4 at a
+// time for what is left.
+__attribute__((target("avx2"))) static int u8_to_planes_avx2(const unsigned char *src, int n, int c, float *dst,
+                                                              int p)
+{
+    const __m256 scale = _mm256_set1_ps(U8_TO_FLOAT);
+    __m128i deinterleave = c == 3 ? _mm_setr_epi8(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1)
+                                  : _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    if (c == 1)
+    {
+        for (; p + 8 <= n; p += 8)
+        {
+            __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + p)));
+            _mm256_storeu_ps(dst + p, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+        }
+    }
+    else if (c == 3 || c == 4)
+    {
+        // Two 16-byte loads cover 8 pixels; the second must not run past the end.
+        for (; c * (p + 4) + 16 <= c * n; p += 8)
+        {
+            __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + c * p)), deinterleave);
+            __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + c * (p + 4))), deinterleave);
+            __m128i lo = _mm_unpacklo_epi32(a, b); // channels 0 and 1 of all 8 pixels
+            __m128i hi = _mm_unpackhi_epi32(a, b); // channels 2 and 3
+            for (int k = 0; k < c; ++k)
+            {
+                if (k == 2)
+                    lo = hi;
+                __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(lo));
+                _mm256_storeu_ps(dst + k * n + p, _mm256_mul_ps(f, scale));
+                lo = _mm_srli_si128(lo, 8);
+            }
+        }
+    }
+    return u8_to_planes_sse41(src, n, c, dst, p);
+}
+
+// Converts pixels [p, n) of planes_to_u8 4 at a time with SSE4.1: they are
+// converted, packed with saturation and shuffled into pixel order.
+// returns: the first pixel left for the scalar loop.
+__attribute__((target("sse4.1"))) static int planes_to_u8_sse41(const float *src, int n, int c, unsigned char *dst,
+                                                                 int p)
+{
+    if (c != 1 && c != 3 && c != 4)
+        return p;
+    const __m128 scale = _mm_set1_ps(255), lo = _mm_setzero_ps(), hi = _mm_set1_ps(255), half = _mm_set1_ps(.5f);
+    // Takes byte k of each pixel from bytes 4k..4k+3, the packed channels.
+    __m128i interleave = c == 1   ? _mm_setr_epi8(0, 1, 2, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)
+                         : c == 3 ? _mm_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1)
+                                  : _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    // Each store writes 16 bytes, of which the 4 pixels use 4 * c.
+    for (; c * p + 16 <= c * n; p += 4)
+    {
+        __m128i v[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            __m128 f = k < c ? _mm_loadu_ps(src + k * n + p) : lo;
+            f = _mm_min_ps(_mm_max_ps(_mm_mul_ps(f, scale), lo), hi);
+            v[k] = _mm_cvttps_epi32(_mm_add_ps(f, half));
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packus_epi32(v[0], v[1]), _mm_packus_epi32(v[2], v[3]));
+        _mm_storeu_si128((__m128i *)(dst + c * p), _mm_shuffle_epi8(bytes, interleave));
+    }
+    return p;
+}
+#endif
+
+// Leaves every pixel to the scalar loops.
+static int u8_to_planes_none(const unsigned char *src, int n, int c, float *dst, int p)
+{
+    return p;
+}
+
+static int planes_to_u8_none(const float *src, int n, int c, unsigned char *dst, int p)
+{
+    return p;
+}
+
+// The widest conversion kernels this CPU runs, picked on first use.
+static int (*u8_to_planes_kernel)(const unsigned char *, int, int, float *, int) = u8_to_planes_none;
+static int (*planes_to_u8_kernel)(const float *, int, int, unsigned char *, int) = planes_to_u8_none;
+static pthread_once_t u8_kernels_once = PTHREAD_ONCE_INIT;
+
+static void pick_u8_kernels()
+{
+#ifdef UWIMG_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        u8_to_planes_kernel = u8_to_planes_sse41;
+        planes_to_u8_kernel = planes_to_u8_sse41;
+    }
+    if (__builtin_cpu_supports("avx2"))
+        u8_to_planes_kernel = u8_to_planes_avx2;
+#endif
+}
+
+// Converts interleaved 8-bit pixels (HWC) to planar floats in [0, 1] (CHW).
+// const unsigned char *src: n pixels of c bytes each.
+// float *dst: c planes of n floats.
+// The SIMD kernel converts what it can; the rest goes through the scalar loop.
+static void u8_to_planes(const unsigned char *src, int n, int c, float *dst)
+{
+    pthread_once(&u8_kernels_once, pick_u8_kernels);
+    int p = u8_to_planes_kernel(src, n, c, dst, 0);
+    for (int k = 0; k < c; ++k)
+    {
+        for (int i = p; i < n; ++i)
+        {
+            dst[k * n + i] = src[i * c + k] * U8_TO_FLOAT;
+        }
+    }
+}
+
+// Clamps planar floats (CHW) to [0, 1], scales them to 0..255, rounds half up
+// and interleaves them into 8-bit pixels (HWC); the reverse of u8_to_planes.
+static void planes_to_u8(const float *src, int n, int c, unsigned char *dst)
+{
+    pthread_once(&u8_kernels_once, pick_u8_kernels);
+    int p = planes_to_u8_kernel(src, n, c, dst, 0);
+    for (int k = 0; k < c; ++k)
+    {
+        for (int i = p; i < n; ++i)
+        {
+            float v = MIN(MAX(src[k * n + i] * 255, 0), 255);
+            dst[i * c + k] = (unsigned char)(int)(v + .5f);
+        }
+    }
+}
+
+// Converts interleaved 8-bit pixels (HWC, as stb loads them) to a new image.
+image u8_to_image(const unsigned char *data, int w, int h, int c)
+{
+    image im = make_image(w, h, c);
+    u8_to_planes(data, w * h, c, im.data);
+    return im;
+}
+
+// Converts an image to interleaved 8-bit pixels (HWC, as stb saves them),
+// clamping values to [0, 1] first.
+// unsigned char *data: room for w * h * c bytes.
+void image_to_u8(image im, unsigned char *data)
+{
+    planes_to_u8(im.data, im.w * im.h, im.c, data);
+}
+
+void save_image_stb(image im, const char *name, int png)
+{
+    char buff[256];
+    unsigned char *data = malloc(im.w * im.h * im.c);
+    image_to_u8(im, data);
     int success = 0;
     if (png)
     {
@@ -81,20 +474,7 @@ image load_image_stb(char *filename, int channels)
     }
     if (channels)
         c = channels;
-    int i, j, k;
-    image im = make_image(w, h, c);
-    for (k = 0; k < c; ++k)
-    {
-        for (j = 0; j < h; ++j)
-        {
-            for (i = 0; i < w; ++i)
-            {
-                int dst_index = i + w * j + w * h * k;
-                int src_index = k + c * i + c * w * j;
-                im.data[dst_index] = (float)data[src_index] / 255.;
-            }
-        }
-    }
+    image im = u8_to_image(data, w, h, c);
     // We don't like alpha channels, #YOLO
     if (im.c == 4)
         im.c = 3;
@@ -110,5 +490,5 @@ image load_image(char *filename)
 
 void free_image(image im)
 {
-    free(im.data);
+    uwimg_aligned_free(im.data);
 }
\ No newline at end of file
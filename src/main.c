@@ -10,9 +10,11 @@ int main(int argc, char **argv)
     char *out = find_char_arg(argc, argv, "-o", "out");
     //float scale = find_float_arg(argc, argv, "-s", 1);
     if(argc < 2){
-        printf("usage: %s [test | grayscale]\n", argv[0]);  
+        printf("usage: %s [test | bench | grayscale]\n", argv[0]);  
     } else if (0 == strcmp(argv[1], "test")){
         run_tests();
+    } else if (0 == strcmp(argv[1], "bench")){
+        run_benchmarks();
     } else if (0 == strcmp(argv[1], "grayscale")){
         image im = load_image(in);
         image g = rgb_to_grayscale(im);
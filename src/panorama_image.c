@@ -3,12 +3,21 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <float.h>
+#include <limits.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 // Comparator for matches
 // const void *a, *b: pointers to the matches to compare.
-// returns: result of comparison, 0 if same, 1 if a > b, -1 if a < b.
+// returns: result of comparison, 0 if same, 1 if a > b, -1 if a < b. Equal
+//          distances order by ai, so the order does not depend on how qsort
+//          treats ties.
 int match_compare(const void *a, const void *b)
 {
     match *ra = (match *)a;
@@ -18,7 +27,7 @@ int match_compare(const void *a, const void *b)
     else if (ra->distance > rb->distance)
         return 1;
     else
-        return 0;
+        return (ra->ai > rb->ai) - (ra->ai < rb->ai);
 }
 
 // Place two images side by side on canvas, for drawing matching pixels.
@@ -27,27 +36,8 @@ int match_compare(const void *a, const void *b)
 image both_images(image a, image b)
 {
     image both = make_image(a.w + b.w, a.h > b.h ? a.h : b.h, a.c > b.c ? a.c : b.c);
-    int i, j, k;
-    for (k = 0; k < a.c; ++k)
-    {
-        for (j = 0; j < a.h; ++j)
-        {
-            for (i = 0; i < a.w; ++i)
-            {
-                set_pixel(both, i, j, k, get_pixel(a, i, j, k));
-            }
-        }
-    }
-    for (k = 0; k < b.c; ++k)
-    {
-        for (j = 0; j < b.h; ++j)
-        {
-            for (i = 0; i < b.w; ++i)
-            {
-                set_pixel(both, i + a.w, j, k, get_pixel(b, i, j, k));
-            }
-        }
-    }
+    paste_strided_image(image_view(both, 0, 0, a.w, a.h), image_as_strided(a));
+    paste_strided_image(image_view(both, a.w, 0, b.w, b.h), image_as_strided(b));
     return both;
 }
 
@@ -95,19 +85,17 @@ image draw_inliers(image a, image b, matrix H, match *m, int n, float thresh)
 // int nms: window to perform nms on. Typical: 3
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms)
 {
-    int an = 0;
-    int bn = 0;
     int mn = 0;
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
-    match *m = match_descriptors(ad, an, bd, bn, &mn);
+    descriptor_set ad = harris_descriptor_set(a, sigma, thresh, nms);
+    descriptor_set bd = harris_descriptor_set(b, sigma, thresh, nms);
+    match *m = match_descriptor_sets(ad, bd, &mn);
 
-    mark_corners(a, ad, an);
-    mark_corners(b, bd, bn);
+    mark_descriptor_set(a, ad);
+    mark_descriptor_set(b, bd);
     image lines = draw_matches(a, b, m, mn, 0);
 
-    free_descriptors(ad, an);
-    free_descriptors(bd, bn);
+    free_descriptor_set(ad);
+    free_descriptor_set(bd);
     free(m);
     return lines;
 }
@@ -134,6 +122,143 @@ float l1_distance(float *a, float *b, int n)
     return l1_summed;
 }
 
+// Float lanes the L1 kernel accumulates in, as one AVX2 register or a pair
+// of SSE ones, reduced in the same order either way.
+#define L1_LANES 8
+
+#if defined(__AVX2__)
+static inline float l1_reduce_avx(__m256 acc)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#elif defined(__SSE2__)
+static inline float l1_reduce_sse(__m128 lo, __m128 hi)
+{
+    __m128 s = _mm_add_ps(lo, hi);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+// Offers candidate i at distance d; the earlier candidate wins ties.
+static inline void nearest_two_offer(nearest_two *r, int i, float d)
+{
+    if (d < r->d1)
+    {
+        r->d2 = r->d1;
+        r->d1 = d;
+        r->best = i;
+    }
+    else if (d < r->d2)
+    {
+        r->d2 = d;
+    }
+}
+
+// For the mutual check: column[i] holds the nearest descriptor of a to row i
+// of b seen so far as a key of its distance's bits over its index. Distances
+// are never negative, so comparing keys compares distances, then indices, and
+// the result does not depend on which thread gets there first.
+static inline void column_offer(uint64_t *column, int i, int qi, float d)
+{
+    uint32_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    uint64_t key = (uint64_t)bits << 32 | (uint32_t)qi;
+    uint64_t old = __atomic_load_n(column + i, __ATOMIC_RELAXED);
+    while (key < old && !__atomic_compare_exchange_n(column + i, &old, key, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Offers candidate i at distance d to query qi's nearest two and, unless
+// column is null, qi to candidate i's column.
+static inline void scan_offer(nearest_two *r, uint64_t *column, int qi, int i, float d)
+{
+    nearest_two_offer(r, i, d);
+    if (column)
+        column_offer(column, i, qi, d);
+}
+
+// Scans rows [start, end) of a block for the nearest two to query qi, also
+// offering qi to each row's column when column is not null.
+static inline nearest_two l1_scan(const float *q, strided_image rows, int start, int end, uint64_t *column, int qi)
+{
+    nearest_two r = {-1, FLT_MAX, FLT_MAX};
+    int n = (rows.w + L1_LANES - 1) / L1_LANES * L1_LANES;
+    assert(n <= rows.stride);
+    int i = start;
+
+#if defined(__AVX2__)
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    // Four candidates at a time share each load of the query.
+    for (; i + 4 <= end; i += 4)
+    {
+        const float *r0 = strided_row(rows, 0, i), *r1 = r0 + rows.stride, *r2 = r1 + rows.stride,
+                    *r3 = r2 + rows.stride;
+        __m256 a0 = _mm256_setzero_ps(), a1 = a0, a2 = a0, a3 = a0;
+        for (int k = 0; k < n; k += L1_LANES)
+        {
+            __m256 qk = _mm256_loadu_ps(q + k);
+            a0 = _mm256_add_ps(a0, _mm256_andnot_ps(sign, _mm256_sub_ps(qk, _mm256_load_ps(r0 + k))));
+            a1 = _mm256_add_ps(a1, _mm256_andnot_ps(sign, _mm256_sub_ps(qk, _mm256_load_ps(r1 + k))));
+            a2 = _mm256_add_ps(a2, _mm256_andnot_ps(sign, _mm256_sub_ps(qk, _mm256_load_ps(r2 + k))));
+            a3 = _mm256_add_ps(a3, _mm256_andnot_ps(sign, _mm256_sub_ps(qk, _mm256_load_ps(r3 + k))));
+        }
+        scan_offer(&r, column, qi, i, l1_reduce_avx(a0));
+        scan_offer(&r, column, qi, i + 1, l1_reduce_avx(a1));
+        scan_offer(&r, column, qi, i + 2, l1_reduce_avx(a2));
+        scan_offer(&r, column, qi, i + 3, l1_reduce_avx(a3));
+    }
+    for (; i < end; ++i)
+    {
+        const float *row = strided_row(rows, 0, i);
+        __m256 acc = _mm256_setzero_ps();
+        for (int k = 0; k < n; k += L1_LANES)
+            acc = _mm256_add_ps(acc, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(q + k), _mm256_load_ps(row + k))));
+        scan_offer(&r, column, qi, i, l1_reduce_avx(acc));
+    }
+#elif defined(__SSE2__)
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    for (; i < end; ++i)
+    {
+        const float *row = strided_row(rows, 0, i);
+        __m128 lo = _mm_setzero_ps(), hi = lo;
+        for (int k = 0; k < n; k += L1_LANES)
+        {
+            lo = _mm_add_ps(lo, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(q + k), _mm_load_ps(row + k))));
+            hi = _mm_add_ps(hi, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(q + k + 4), _mm_load_ps(row + k + 4))));
+        }
+        scan_offer(&r, column, qi, i, l1_reduce_sse(lo, hi));
+    }
+#else
+    for (; i < end; ++i)
+    {
+        const float *row = strided_row(rows, 0, i);
+        float d = 0;
+        for (int k = 0; k < n; ++k)
+            d += fabsf(q[k] - row[k]);
+        scan_offer(&r, column, qi, i, d);
+    }
+#endif
+    return r;
+}
+
+// L1 distances from one descriptor to the rows [start, end) of a block,
+// keeping only the nearest two.
+// const float *q: the query, rows.stride floats with zeros past rows.w, such
+//                 as a row of another descriptor set of the same length.
+// strided_image rows: candidate descriptors, one per row, zero-padded like
+//                     descriptor_set rows.
+// returns: index and distance of the nearest row and the second smallest
+//          distance; best is -1 and distances FLT_MAX if the range is empty.
+nearest_two l1_nearest_two(const float *q, strided_image rows, int start, int end)
+{
+    return l1_scan(q, rows, start, end, 0, 0);
+}
+
 /*void shift_to_left(match *m, int n,  int start_index){
 
     for (int i = start_index; i<n; ++i){
@@ -142,46 +267,263 @@ float l1_distance(float *a, float *b, int n)
 
 } chaiyo vane chalaula*/
 
-// Finds best matches between descriptors of two images.
-// descriptor *a, *b: array of descriptors for pixels in two images.
-// int an, bn: number of descriptors in arrays a and b.
-// int *mn: pointer to number of matches found, to be filled in by function.
-// returns: best matches found. each descriptor in a should match with at most
-//          one other descriptor in b.
-match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
+// Approximate matching: a randomized KD-forest over b's descriptors. Each
+// tree splits on a dimension drawn from the few with the highest variance, so
+// the trees differ; a search walks all of them from one priority queue of
+// unexplored branches and stops after a fixed number of distance checks.
+#define KD_TREES 4
+#define KD_LEAF_SIZE 8
+#define KD_TOP_DIMS 5
+#define KD_SAMPLE 128
+
+// An inner node splits on rows[dim] < split; a leaf (dim < 0) holds the
+// count rows at order[start] of its tree.
+typedef struct
 {
-    int i, j;
+    int dim;
+    float split;
+    int left, right;
+    int start, count;
+} kd_node;
 
-    // We will have at most an matches.
-    *mn = an;
-    match *m = calloc(an, sizeof(match));
-    for (j = 0; j < an; ++j)
-    {
-        // TODO: for every descriptor in a, find best match in b.
-        // record ai as the index in *a and bi as the index in *b.
-        int bind = 0; // <- find the best match
-        m[j].ai = j;
-        m[j].bi = bind; // <- should be index in b.
-        m[j].p = a[j].p;
-        m[j].q = b[bind].p;
-        m[j].distance = 99999999; // <- should be the smallest L1 distance!
-
-        for (i = 0; i < bn; ++i)
+typedef struct
+{
+    descriptor_set set;
+    int roots[KD_TREES];
+    kd_node *nodes;
+    int n_nodes;
+    int *order; // KD_TREES permutations of the rows, leaves index into these
+} kd_forest;
+
+static unsigned int kd_random(unsigned int *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// Builds the subtree over order[lo, hi) and returns its node.
+static int kd_build(kd_forest *f, int *order, int lo, int hi, unsigned int *rng)
+{
+    int node = f->n_nodes++;
+    kd_node *k = f->nodes + node;
+    int dim = f->set.dim;
+    if (hi - lo <= KD_LEAF_SIZE)
+    {
+        *k = (kd_node){-1, 0, -1, -1, lo, hi - lo};
+        return node;
+    }
+
+    // Mean and variance of every dimension over a sample of the rows; order
+    // is shuffled, so its first rows are a random sample.
+    int sample = MIN(hi - lo, KD_SAMPLE);
+    float *mean = calloc(2 * dim, sizeof(float)), *var = mean + dim;
+    for (int i = lo; i < lo + sample; ++i)
+    {
+        const float *row = strided_row(f->set.rows, 0, order[i]);
+        for (int d = 0; d < dim; ++d)
+            mean[d] += row[d];
+    }
+    for (int d = 0; d < dim; ++d)
+        mean[d] /= sample;
+    for (int i = lo; i < lo + sample; ++i)
+    {
+        const float *row = strided_row(f->set.rows, 0, order[i]);
+        for (int d = 0; d < dim; ++d)
+            var[d] += (row[d] - mean[d]) * (row[d] - mean[d]);
+    }
+
+    int top[KD_TOP_DIMS], n_top = 0;
+    for (int d = 0; d < dim; ++d)
+    {
+        int at = n_top < KD_TOP_DIMS ? n_top++ : KD_TOP_DIMS;
+        while (at > 0 && var[top[at - 1]] < var[d])
+        {
+            if (at < KD_TOP_DIMS)
+                top[at] = top[at - 1];
+            --at;
+        }
+        if (at < KD_TOP_DIMS)
+            top[at] = d;
+    }
+    int split_dim = top[kd_random(rng) % n_top];
+    float split = mean[split_dim];
+    free(mean);
+
+    int i = lo, j = hi - 1;
+    while (i <= j)
+    {
+        if (strided_row(f->set.rows, 0, order[i])[split_dim] < split)
         {
+            ++i;
+        }
+        else
+        {
+            int t = order[i];
+            order[i] = order[j];
+            order[j--] = t;
+        }
+    }
+    // All rows on one side (duplicates): split the range in half instead.
+    int mid = (i == lo || i == hi) ? (lo + hi) / 2 : i;
 
-            float l1_dist = l1_distance(a[j].data, b[i].data, a[j].n);
+    int left = kd_build(f, order, lo, mid, rng);
+    int right = kd_build(f, order, mid, hi, rng);
+    f->nodes[node] = (kd_node){split_dim, split, left, right, 0, 0};
+    return node;
+}
 
-            if (l1_dist < m[j].distance)
-            {
-                m[j].bi = i;
-                m[j].q = b[i].p;
-                m[j].distance = l1_dist;
-            }
+static kd_forest make_kd_forest(descriptor_set s)
+{
+    kd_forest f = {0};
+    f.set = s;
+    f.nodes = calloc((size_t)KD_TREES * 2 * MAX(s.n, 1), sizeof(kd_node));
+    f.order = calloc((size_t)KD_TREES * MAX(s.n, 1), sizeof(int));
+    for (int t = 0; t < KD_TREES; ++t)
+    {
+        int *order = f.order + (long)t * s.n;
+        unsigned int rng = 12345 + 7919 * t;
+        for (int i = 0; i < s.n; ++i)
+            order[i] = i;
+        for (int i = s.n - 1; i > 0; --i)
+        {
+            int r = kd_random(&rng) % (i + 1), tmp = order[i];
+            order[i] = order[r];
+            order[r] = tmp;
         }
+        f.roots[t] = kd_build(&f, order, 0, s.n, &rng);
     }
+    return f;
+}
+
+static void free_kd_forest(kd_forest f)
+{
+    free(f.nodes);
+    free(f.order);
+}
+
+// A branch not taken on the way down and a lower bound on its distance.
+typedef struct
+{
+    float bound;
+    int node, tree;
+} kd_branch;
 
+// Per-thread scratch for searches: the branch heap and which rows the current
+// query has already measured (seen[i] == query).
+typedef struct
+{
+    kd_branch *heap;
+    int n_heap, cap_heap;
+    int *seen;
+    int query;
+    uint64_t *column; // null, or the mutual check's columns, offered qi
+    int qi;
+} kd_search;
+
+static void kd_push(kd_search *s, kd_branch b)
+{
+    if (s->n_heap == s->cap_heap)
+    {
+        s->cap_heap = MAX(64, 2 * s->cap_heap);
+        s->heap = realloc(s->heap, s->cap_heap * sizeof(kd_branch));
+    }
+    int i = s->n_heap++;
+    while (i > 0 && s->heap[(i - 1) / 2].bound > b.bound)
+    {
+        s->heap[i] = s->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->heap[i] = b;
+}
+
+static kd_branch kd_pop(kd_search *s)
+{
+    kd_branch top = s->heap[0], last = s->heap[--s->n_heap];
+    int i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= s->n_heap)
+            break;
+        if (child + 1 < s->n_heap && s->heap[child + 1].bound < s->heap[child].bound)
+            ++child;
+        if (s->heap[child].bound >= last.bound)
+            break;
+        s->heap[i] = s->heap[child];
+        i = child;
+    }
+    s->heap[i] = last;
+    return top;
+}
+
+// Walks from node to a leaf, queueing the far side of every split, then
+// measures the leaf's rows. Returns how many distances it computed.
+static int kd_descend(const kd_forest *f, kd_search *s, const float *q, int node, int tree, float bound,
+                      nearest_two *r)
+{
+    const kd_node *k = f->nodes + node;
+    while (k->dim >= 0)
+    {
+        float diff = q[k->dim] - k->split;
+        kd_push(s, (kd_branch){bound + fabsf(diff), diff < 0 ? k->right : k->left, tree});
+        k = f->nodes + (diff < 0 ? k->left : k->right);
+    }
+    const int *order = f->order + (long)tree * f->set.n;
+    int checked = 0;
+    for (int i = k->start; i < k->start + k->count; ++i)
+    {
+        int row = order[i];
+        if (s->seen[row] == s->query)
+            continue;
+        s->seen[row] = s->query;
+        float d = l1_nearest_two(q, f->set.rows, row, row + 1).d1;
+        ++checked;
+        if (s->column)
+            column_offer(s->column, row, s->qi, d);
+        // Rows arrive out of order, so ties go to the lower index explicitly.
+        if (d < r->d1 || (d == r->d1 && row < r->best))
+        {
+            r->d2 = r->d1;
+            r->d1 = d;
+            r->best = row;
+        }
+        else if (d < r->d2)
+        {
+            r->d2 = d;
+        }
+    }
+    return checked;
+}
+
+// Approximate nearest two of q among the forest's rows after about checks
+// distance computations.
+static nearest_two kd_forest_nearest_two(const kd_forest *f, kd_search *s, const float *q, int checks)
+{
+    nearest_two r = {-1, FLT_MAX, FLT_MAX};
+    s->n_heap = 0;
+    ++s->query;
+    int checked = 0;
+    for (int t = 0; t < KD_TREES; ++t)
+        checked += kd_descend(f, s, q, f->roots[t], t, 0, &r);
+    while (s->n_heap && checked < checks)
+    {
+        kd_branch b = kd_pop(s);
+        if (b.bound >= r.d2)
+            continue;
+        checked += kd_descend(f, s, q, b.node, b.tree, b.bound, &r);
+    }
+    return r;
+}
+
+// Sorts one candidate match per descriptor of a by distance and keeps the
+// best one for each descriptor of b.
+// match *m: an candidates, reallocated to the ones kept.
+// int bn: number of descriptors in b.
+// int *mn: filled with the number kept.
+static match *unique_matches(match *m, int an, int bn, int *mn)
+{
     int count = 0;
-    int *seen = calloc(bn, sizeof(int));
+    int *seen = calloc(bn + 1, sizeof(int));
 
     qsort(m, an, sizeof(match), match_compare);
 
@@ -201,6 +543,503 @@ match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
     return m;
 }
 
+// Descriptor sets being matched and the match slot for each descriptor in a,
+// shared by the threads searching them.
+typedef struct
+{
+    descriptor_set a, b;
+    match *m;
+    float *second;    // second nearest distance for each descriptor in a
+    uint64_t *column; // null, or the nearest a for each b, for the mutual check
+    kd_forest *forest; // null for exact search
+    int checks;
+} match_job;
+
+// Finds the nearest descriptor in b for a's descriptors [j0, j1).
+static void match_rows(void *ctx, int j0, int j1)
+{
+    match_job *job = ctx;
+    descriptor_set a = job->a, b = job->b;
+    kd_search search = {0};
+    search.column = job->column;
+    if (job->forest)
+        search.seen = calloc(b.n, sizeof(int));
+
+    for (int j = j0; j < j1; ++j)
+    {
+        const float *q = strided_row(a.rows, 0, j);
+        search.qi = j;
+        nearest_two near = job->forest ? kd_forest_nearest_two(job->forest, &search, q, job->checks)
+                                       : l1_scan(q, b.rows, 0, b.n, job->column, j);
+        job->second[j] = near.d2;
+        int bind = near.best < 0 ? 0 : near.best;
+        match *m = job->m + j;
+        m->ai = j;
+        m->bi = bind;
+        m->p = make_point(a.x[j], a.y[j]);
+        m->q = b.n ? make_point(b.x[bind], b.y[bind]) : make_point(0, 0);
+        m->distance = near.best < 0 ? 99999999 : near.d1;
+    }
+    free(search.heap);
+    free(search.seen);
+}
+
+// L2 matching works out every squared distance as |a|^2 + |b|^2 - 2 a.b, so
+// the bulk of it is the product of a with b transposed. b is packed once into
+// panels of L2_COLS descriptors stored dimension-major, a microkernel
+// multiplies L2_ROWS rows of a by one panel with its sums held in registers,
+// and a thread works through L2_BLOCK descriptors of b at a time so they stay
+// in cache while all of its rows of a pass over them. Each row only keeps its
+// nearest two, so the an x bn distance matrix is never stored.
+#define L2_ROWS 4
+#if defined(__AVX2__)
+#define L2_COLS 16
+#else
+#define L2_COLS 8
+#endif
+#define L2_BLOCK 256
+
+// Descriptor sets being matched by L2, with b packed, shared by the threads
+// searching them.
+typedef struct
+{
+    descriptor_set a, b;
+    const float *panels; // b as ceil(bn / L2_COLS) panels of dim x L2_COLS
+    const float *norms;  // |b|^2, padded to whole panels
+    match *m;
+    float *second;
+    uint64_t *column;
+} l2_match_job;
+
+// Packs b into L2_COLS-wide dimension-major panels, zero past b.n, and
+// fills in its squared norms.
+static float *pack_l2_panels(descriptor_set b, float *norms)
+{
+    int panels = (b.n + L2_COLS - 1) / L2_COLS;
+    float *packed = calloc((size_t)panels * L2_COLS * b.dim + 1, sizeof(float));
+    for (int i = 0; i < b.n; ++i)
+    {
+        const float *row = strided_row(b.rows, 0, i);
+        float *panel = packed + (size_t)(i / L2_COLS) * L2_COLS * b.dim + i % L2_COLS;
+        float norm = 0;
+        for (int k = 0; k < b.dim; ++k)
+        {
+            panel[k * L2_COLS] = row[k];
+            norm += row[k] * row[k];
+        }
+        norms[i] = norm;
+    }
+    return packed;
+}
+
+// Dot products of L2_ROWS descriptors with the L2_COLS of one panel.
+static inline void l2_microkernel(const float *const *rows, const float *panel, int dim, float c[L2_ROWS][L2_COLS])
+{
+#if defined(__AVX2__)
+    __m256 c00 = _mm256_setzero_ps(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00, c30 = c00, c31 = c00;
+    for (int k = 0; k < dim; ++k, panel += L2_COLS)
+    {
+        __m256 p0 = _mm256_loadu_ps(panel), p1 = _mm256_loadu_ps(panel + 8);
+        __m256 v = _mm256_broadcast_ss(rows[0] + k);
+        c00 = _mm256_add_ps(c00, _mm256_mul_ps(v, p0));
+        c01 = _mm256_add_ps(c01, _mm256_mul_ps(v, p1));
+        v = _mm256_broadcast_ss(rows[1] + k);
+        c10 = _mm256_add_ps(c10, _mm256_mul_ps(v, p0));
+        c11 = _mm256_add_ps(c11, _mm256_mul_ps(v, p1));
+        v = _mm256_broadcast_ss(rows[2] + k);
+        c20 = _mm256_add_ps(c20, _mm256_mul_ps(v, p0));
+        c21 = _mm256_add_ps(c21, _mm256_mul_ps(v, p1));
+        v = _mm256_broadcast_ss(rows[3] + k);
+        c30 = _mm256_add_ps(c30, _mm256_mul_ps(v, p0));
+        c31 = _mm256_add_ps(c31, _mm256_mul_ps(v, p1));
+    }
+    _mm256_storeu_ps(c[0], c00);
+    _mm256_storeu_ps(c[0] + 8, c01);
+    _mm256_storeu_ps(c[1], c10);
+    _mm256_storeu_ps(c[1] + 8, c11);
+    _mm256_storeu_ps(c[2], c20);
+    _mm256_storeu_ps(c[2] + 8, c21);
+    _mm256_storeu_ps(c[3], c30);
+    _mm256_storeu_ps(c[3] + 8, c31);
+#elif defined(__SSE2__)
+    __m128 c00 = _mm_setzero_ps(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00, c30 = c00, c31 = c00;
+    for (int k = 0; k < dim; ++k, panel += L2_COLS)
+    {
+        __m128 p0 = _mm_loadu_ps(panel), p1 = _mm_loadu_ps(panel + 4);
+        __m128 v = _mm_set1_ps(rows[0][k]);
+        c00 = _mm_add_ps(c00, _mm_mul_ps(v, p0));
+        c01 = _mm_add_ps(c01, _mm_mul_ps(v, p1));
+        v = _mm_set1_ps(rows[1][k]);
+        c10 = _mm_add_ps(c10, _mm_mul_ps(v, p0));
+        c11 = _mm_add_ps(c11, _mm_mul_ps(v, p1));
+        v = _mm_set1_ps(rows[2][k]);
+        c20 = _mm_add_ps(c20, _mm_mul_ps(v, p0));
+        c21 = _mm_add_ps(c21, _mm_mul_ps(v, p1));
+        v = _mm_set1_ps(rows[3][k]);
+        c30 = _mm_add_ps(c30, _mm_mul_ps(v, p0));
+        c31 = _mm_add_ps(c31, _mm_mul_ps(v, p1));
+    }
+    _mm_storeu_ps(c[0], c00);
+    _mm_storeu_ps(c[0] + 4, c01);
+    _mm_storeu_ps(c[1], c10);
+    _mm_storeu_ps(c[1] + 4, c11);
+    _mm_storeu_ps(c[2], c20);
+    _mm_storeu_ps(c[2] + 4, c21);
+    _mm_storeu_ps(c[3], c30);
+    _mm_storeu_ps(c[3] + 4, c31);
+#else
+    for (int r = 0; r < L2_ROWS; ++r)
+        for (int j = 0; j < L2_COLS; ++j)
+            c[r][j] = 0;
+    for (int k = 0; k < dim; ++k, panel += L2_COLS)
+        for (int r = 0; r < L2_ROWS; ++r)
+            for (int j = 0; j < L2_COLS; ++j)
+                c[r][j] += rows[r][k] * panel[j];
+#endif
+}
+
+// Finds the nearest descriptor in b by L2 for a's descriptors [j0, j1).
+static void l2_match_rows(void *ctx, int j0, int j1)
+{
+    l2_match_job *job = ctx;
+    descriptor_set a = job->a, b = job->b;
+    int n = j1 - j0, dim = b.dim;
+    nearest_two *near = malloc(n * sizeof(nearest_two));
+    float *anorm = malloc(n * sizeof(float));
+    for (int j = 0; j < n; ++j)
+    {
+        const float *row = strided_row(a.rows, 0, j0 + j);
+        float norm = 0;
+        for (int k = 0; k < dim; ++k)
+            norm += row[k] * row[k];
+        anorm[j] = norm;
+        near[j] = (nearest_two){-1, FLT_MAX, FLT_MAX};
+    }
+
+    float c[L2_ROWS][L2_COLS];
+    for (int b0 = 0; b0 < b.n; b0 += L2_BLOCK)
+    {
+        int b1 = MIN(b0 + L2_BLOCK, b.n);
+        for (int j = 0; j < n; j += L2_ROWS)
+        {
+            // A short last group repeats its final row and drops the copies.
+            const float *rows[L2_ROWS];
+            for (int r = 0; r < L2_ROWS; ++r)
+                rows[r] = strided_row(a.rows, 0, j0 + MIN(j + r, n - 1));
+            int rn = MIN(L2_ROWS, n - j);
+
+            for (int p = b0; p < b1; p += L2_COLS)
+            {
+                l2_microkernel(rows, job->panels + (size_t)p * dim, dim, c);
+                int cols = MIN(L2_COLS, b1 - p);
+                for (int r = 0; r < rn; ++r)
+                {
+                    // Most panels hold nothing closer than the row's second
+                    // nearest so far; check all of them at once first.
+                    float d[L2_COLS], low = FLT_MAX;
+                    for (int i = 0; i < L2_COLS; ++i)
+                    {
+                        d[i] = anorm[j + r] + job->norms[p + i] - 2 * c[r][i];
+                        low = d[i] < low ? d[i] : low;
+                    }
+                    if (job->column)
+                    {
+                        for (int i = 0; i < cols; ++i)
+                            column_offer(job->column, p + i, j0 + j + r, d[i] > 0 ? d[i] : 0);
+                    }
+                    if (low >= near[j + r].d2)
+                        continue;
+                    for (int i = 0; i < cols; ++i)
+                        nearest_two_offer(near + j + r, p + i, d[i] > 0 ? d[i] : 0);
+                }
+            }
+        }
+    }
+
+    for (int j = 0; j < n; ++j)
+    {
+        int bind = near[j].best < 0 ? 0 : near[j].best;
+        match *m = job->m + j0 + j;
+        m->ai = j0 + j;
+        m->bi = bind;
+        m->p = make_point(a.x[j0 + j], a.y[j0 + j]);
+        m->q = b.n ? make_point(b.x[bind], b.y[bind]) : make_point(0, 0);
+        m->distance = near[j].best < 0 ? 99999999 : sqrtf(near[j].d1);
+        job->second[j0 + j] = sqrtf(near[j].d2);
+    }
+    free(near);
+    free(anorm);
+}
+
+// Nearest neighbours by Euclidean distance for every descriptor in a, one
+// slot each in m, with the second nearest distance in second and, unless
+// column is null, the nearest a to each b in column.
+static void match_descriptor_sets_l2(descriptor_set a, descriptor_set b, match *m, float *second, uint64_t *column)
+{
+    assert(a.dim == b.dim);
+    float *norms = calloc(b.n + L2_COLS, sizeof(float));
+    float *panels = pack_l2_panels(b, norms);
+    l2_match_job job = {a, b, panels, norms, m, second, column};
+    parallel_for(a.n, 64, l2_match_rows, &job);
+    free(panels);
+    free(norms);
+}
+
+// Drops the candidates that fail the ratio test or, with column, the mutual
+// check, then keeps the best one for each descriptor of b.
+// match *m: an candidates, m[j] for descriptor j of a.
+// const float *second: distance to each one's second nearest.
+// const uint64_t *column: null, or the key of the nearest a to each b.
+// float ratio: ratio test threshold, 0 for none.
+static match *filter_matches(match *m, const float *second, const uint64_t *column, float ratio, int an, int bn,
+                             int *mn)
+{
+    int count = 0;
+    for (int j = 0; j < an; ++j)
+    {
+        if (ratio > 0 && !(m[j].distance < ratio * second[j]))
+            continue;
+        if (column && (uint32_t)column[m[j].bi] != (uint32_t)j)
+            continue;
+        m[count++] = m[j];
+    }
+    return unique_matches(m, count, bn, mn);
+}
+
+// Finds best matches between two descriptor sets by exhaustive L1 search.
+// descriptor_set a, b: descriptors for pixels in two images.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: best matches found. each descriptor in a should match with at most
+//          one other descriptor in b.
+match *match_descriptor_sets(descriptor_set a, descriptor_set b, int *mn)
+{
+    return match_descriptor_sets_ex(a, b, mn, 0);
+}
+
+// Same as match_descriptor_sets with the settings in opt: through a KD-forest
+// over b with ann_checks, by Euclidean distance with MATCH_L2, and with the
+// ratio test and mutual check filtering the matches in the same pass.
+// const panorama_options *opt: null for the defaults.
+match *match_descriptor_sets_ex(descriptor_set a, descriptor_set b, int *mn, const panorama_options *opt)
+{
+    static const panorama_options defaults;
+    opt = opt ? opt : &defaults;
+    int an = a.n, bn = b.n;
+
+    // We will have at most an matches. Each search only writes its own slot,
+    // approximate searches only depend on their query and each column ends up
+    // with its smallest key, so the result does not depend on the thread
+    // count.
+    *mn = an;
+    match *m = calloc(an, sizeof(match));
+    float *second = malloc((an + 1) * sizeof(float));
+    uint64_t *column = 0;
+    if (opt->match_mutual)
+    {
+        column = malloc((bn + 1) * sizeof(uint64_t));
+        memset(column, 0xff, (bn + 1) * sizeof(uint64_t));
+    }
+
+    if (opt->metric == MATCH_L2)
+    {
+        match_descriptor_sets_l2(a, b, m, second, column);
+    }
+    else
+    {
+        match_job job = {a, b, m, second, column, 0, opt->ann_checks};
+        kd_forest forest;
+        if (opt->ann_checks > 0 && opt->ann_checks < bn)
+        {
+            forest = make_kd_forest(b);
+            job.forest = &forest;
+        }
+        parallel_for(an, 32, match_rows, &job);
+        if (job.forest)
+            free_kd_forest(forest);
+    }
+
+    m = filter_matches(m, second, column, opt->match_ratio, an, bn, mn);
+    free(second);
+    free(column);
+    return m;
+}
+
+// Set bits in a word: the popcnt instruction when hardware is set and the
+// caller is built for it, otherwise an inline bit-twiddling count, which beats
+// the library call __builtin_popcountll turns into without popcnt.
+static inline __attribute__((always_inline)) int popcount64(uint64_t x, int hardware)
+{
+    if (hardware)
+        return __builtin_popcountll(x);
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (int)((x * 0x0101010101010101ull) >> 56);
+}
+
+// The closest descriptor in b to q by Hamming distance, with popcount64 as
+// hardware says.
+// int *best_d: set to its distance, INT_MAX if b is empty.
+static inline __attribute__((always_inline)) int nearest_binary(const uint64_t *q, binary_descriptor_set b,
+                                                                int *best_d, int hardware)
+{
+    int best = 0;
+    *best_d = INT_MAX;
+    for (int i = 0; i < b.n; ++i)
+    {
+        const uint64_t *r = b.bits + (long)i * BINARY_DESCRIPTOR_WORDS;
+        int d = 0;
+        for (int w = 0; w < BINARY_DESCRIPTOR_WORDS; ++w)
+            d += popcount64(q[w] ^ r[w], hardware);
+        if (d < *best_d)
+        {
+            *best_d = d;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int nearest_binary_swar(const uint64_t *q, binary_descriptor_set b, int *best_d)
+{
+    return nearest_binary(q, b, best_d, 0);
+}
+
+// The x86 build always carries a popcnt copy of the search, used when the CPU
+// has the instruction.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("popcnt"))) static int nearest_binary_popcnt(const uint64_t *q, binary_descriptor_set b,
+                                                                   int *best_d)
+{
+    return nearest_binary(q, b, best_d, 1);
+}
+#endif
+
+// Binary descriptor sets being matched, shared by the threads searching them.
+typedef struct
+{
+    binary_descriptor_set a, b;
+    match *m;
+    int (*nearest)(const uint64_t *q, binary_descriptor_set b, int *best_d);
+} binary_match_job;
+
+static void binary_match_rows(void *ctx, int j0, int j1)
+{
+    binary_match_job *job = ctx;
+    binary_descriptor_set a = job->a, b = job->b;
+    for (int j = j0; j < j1; ++j)
+    {
+        int best_d;
+        int best = job->nearest(a.bits + (long)j * BINARY_DESCRIPTOR_WORDS, b, &best_d);
+        match *m = job->m + j;
+        m->ai = j;
+        m->bi = best;
+        m->p = make_point(a.x[j], a.y[j]);
+        m->q = b.n ? make_point(b.x[best], b.y[best]) : make_point(0, 0);
+        m->distance = b.n ? best_d : 99999999;
+    }
+}
+
+// Same as match_descriptor_sets for binary descriptors, by Hamming distance.
+match *match_binary_descriptor_sets(binary_descriptor_set a, binary_descriptor_set b, int *mn)
+{
+    match *m = calloc(a.n, sizeof(match));
+    binary_match_job job = {a, b, m, nearest_binary_swar};
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt"))
+        job.nearest = nearest_binary_popcnt;
+#endif
+    parallel_for(a.n, 32, binary_match_rows, &job);
+    return unique_matches(m, a.n, b.n, mn);
+}
+
+// Quantized descriptor sets being matched, shared by the threads searching
+// them.
+typedef struct
+{
+    quantized_descriptor_set a, b;
+    match *m;
+} quantized_match_job;
+
+// Sum of absolute differences of two quantized rows of stride bytes, with
+// vpsadbw (AVX2) or psadbw (SSE2) adding 32 or 16 byte pairs per instruction.
+static inline int sad_distance(const unsigned char *a, const unsigned char *b, int stride)
+{
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (int k = 0; k < stride; k += 32)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_load_si256((const __m256i *)(a + k)),
+                                                    _mm256_load_si256((const __m256i *)(b + k))));
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si32(_mm_add_epi64(s, _mm_unpackhi_epi64(s, s)));
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (int k = 0; k < stride; k += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_load_si128((const __m128i *)(a + k)),
+                                              _mm_load_si128((const __m128i *)(b + k))));
+    return _mm_cvtsi128_si32(_mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc)));
+#else
+    int d = 0;
+    for (int k = 0; k < stride; ++k)
+        d += abs(a[k] - b[k]);
+    return d;
+#endif
+}
+
+static void quantized_match_rows(void *ctx, int j0, int j1)
+{
+    quantized_match_job *job = ctx;
+    quantized_descriptor_set a = job->a, b = job->b;
+    for (int j = j0; j < j1; ++j)
+    {
+        const unsigned char *q = a.rows + (long)j * a.stride;
+        int best = 0, best_d = INT_MAX;
+        for (int i = 0; i < b.n; ++i)
+        {
+            int d = sad_distance(q, b.rows + (long)i * b.stride, b.stride);
+            if (d < best_d)
+            {
+                best_d = d;
+                best = i;
+            }
+        }
+        match *m = job->m + j;
+        m->ai = j;
+        m->bi = best;
+        m->p = make_point(a.x[j], a.y[j]);
+        m->q = b.n ? make_point(b.x[best], b.y[best]) : make_point(0, 0);
+        m->distance = b.n ? best_d / (float)QUANTIZED_DESCRIPTOR_SCALE : 99999999;
+    }
+}
+
+// Same as match_descriptor_sets for quantized descriptors. Distances are
+// scaled back to the units of the float descriptors.
+match *match_quantized_descriptor_sets(quantized_descriptor_set a, quantized_descriptor_set b, int *mn)
+{
+    assert(a.stride == b.stride);
+    match *m = calloc(a.n, sizeof(match));
+    quantized_match_job job = {a, b, m};
+    parallel_for(a.n, 32, quantized_match_rows, &job);
+    return unique_matches(m, a.n, b.n, mn);
+}
+
+// Finds best matches between descriptors of two images.
+// descriptor *a, *b: array of descriptors for pixels in two images.
+// int an, bn: number of descriptors in arrays a and b.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: best matches found. each descriptor in a should match with at most
+//          one other descriptor in b.
+match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
+{
+    descriptor_set as = descriptors_to_set(a, an);
+    descriptor_set bs = descriptors_to_set(b, bn);
+    match *m = match_descriptor_sets(as, bs, mn);
+    free_descriptor_set(as);
+    free_descriptor_set(bs);
+    return m;
+}
+
 // Apply a projective transformation to a point.
 // matrix H: homography to project point.
 // point p: point to project.
@@ -213,18 +1052,28 @@ point project_point(matrix H, point p)
     c.data[1][0] = p.y;
     c.data[2][0] = 1;
     matrix result = matrix_mult_matrix(H, c);
+    free_matrix(c);
 
     float factor = result.data[2][0]; // this represent the w values
 
-    if (factor == 0)
+    point q = make_point(0, 0);
+    if (factor != 0)
     {
-        return make_point(0, 0);
+        q = make_point(result.data[0][0] / factor, result.data[1][0] / factor);
     }
-
-    point q = make_point(result.data[0][0] / factor, result.data[1][0] / factor);
+    free_matrix(result);
     return q;
 }
 
+// Projects p through a homography stored row-major in h.
+static inline point project_homography(const double *h, point p)
+{
+    double w = h[6] * p.x + h[7] * p.y + h[8];
+    if (w == 0)
+        return make_point(0, 0);
+    return make_point((h[0] * p.x + h[1] * p.y + h[2]) / w, (h[3] * p.x + h[4] * p.y + h[5]) / w);
+}
+
 // Calculate L2 distance between two points.
 // point p, q: points.
 // returns: L2 distance between them.
@@ -253,10 +1102,13 @@ void swap(void *a, void *b, size_t size)
 int model_inliers(matrix H, match *m, int n, float thresh)
 {
     int count = 0;
+    double h[9];
+    for (int i = 0; i < 9; ++i)
+        h[i] = H.data[i / 3][i % 3];
 
     for (int i = 0; i < n; ++i)
     {
-        if (point_distance(project_point(H, m[i].p), m[i].q) < thresh)
+        if (point_distance(project_homography(h, m[i].p), m[i].q) < thresh)
             swap(&m[i], &m[count++], sizeof(match)); // we also need to sort. this effectively sorts the list such that inliers will be ahead of outliers
     }
     return count;
@@ -325,21 +1177,246 @@ matrix compute_homography(match *matches, int n)
     if (!a.data)
         return none;
 
+    // The system solves for the first 8 entries; H[2][2] is fixed at 1.
     matrix H = make_matrix(3, 3);
-    int counter = 0;
+    for (int i = 0; i < 8; ++i)
+        H.data[i / 3][i % 3] = a.data[i][0];
+    H.data[2][2] = 1;
+    free_matrix(a);
+    return H;
+}
 
-    for (int i = 0; i < H.rows; ++i)
+// Solves for the homography taking the p of four matches exactly onto their
+// q, by Gaussian elimination with partial pivoting on the stack.
+// const int *idx: indices of the four matches in m.
+// double *h: filled with the homography, row-major with h[8] = 1.
+// returns: 0 if the points are degenerate (three or more in a line).
+static int solve_homography4(const match *m, const int *idx, double *h)
+{
+    double A[8][9];
+    double scale = 0;
+    for (int i = 0; i < 4; ++i)
     {
-        for (int j = 0; j < H.cols; ++j)
+        double x = m[idx[i]].p.x, y = m[idx[i]].p.y, xp = m[idx[i]].q.x, yp = m[idx[i]].q.y;
+        double r0[9] = {x, y, 1, 0, 0, 0, -x * xp, -y * xp, xp};
+        double r1[9] = {0, 0, 0, x, y, 1, -x * yp, -y * yp, yp};
+        memcpy(A[2 * i], r0, sizeof(r0));
+        memcpy(A[2 * i + 1], r1, sizeof(r1));
+        for (int j = 0; j < 8; ++j)
+            scale = fmax(scale, fmax(fabs(r0[j]), fabs(r1[j])));
+    }
+
+    for (int c = 0; c < 8; ++c)
+    {
+        int pivot = c;
+        for (int r = c + 1; r < 8; ++r)
+            if (fabs(A[r][c]) > fabs(A[pivot][c]))
+                pivot = r;
+        if (fabs(A[pivot][c]) <= 1e-12 * scale)
+            return 0;
+        if (pivot != c)
+        {
+            double t[9];
+            memcpy(t, A[c], sizeof(t));
+            memcpy(A[c], A[pivot], sizeof(t));
+            memcpy(A[pivot], t, sizeof(t));
+        }
+        for (int r = c + 1; r < 8; ++r)
         {
-            H.data[i][j] = a.data[counter++][0];
+            double f = A[r][c] / A[c][c];
+            for (int j = c; j < 9; ++j)
+                A[r][j] -= f * A[c][j];
         }
     }
-    free_matrix(a);
-    return H;
+    for (int c = 7; c >= 0; --c)
+    {
+        double v = A[c][8];
+        for (int j = c + 1; j < 8; ++j)
+            v -= A[c][j] * h[j];
+        h[c] = v / A[c][c];
+    }
+    h[8] = 1;
+    return isfinite(h[0] + h[1] + h[2] + h[3] + h[4] + h[5] + h[6] + h[7]);
+}
+
+// Counts the matches whose p lands within thresh of their q under h, without
+// moving them.
+static int count_inliers(const double *h, const match *m, int n, float thresh)
+{
+    float thresh2 = thresh * thresh;
+    int count = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        point p = project_homography(h, m[i].p);
+        float dx = p.x - m[i].q.x, dy = p.y - m[i].q.y;
+        count += dx * dx + dy * dy < thresh2;
+    }
+    return count;
+}
+
+// SPRT after Matas and Chum: a hypothesis is scored match by match, each
+// inlier multiplying the likelihood ratio by delta / epsilon and each outlier
+// by (1 - delta) / (1 - epsilon), and rejected once the ratio passes A.
+// epsilon is the inlier ratio of a good model, taken from the best so far;
+// delta the ratio a bad one still gets, measured on the rejected ones. A
+// balances the matches saved against good models lost, for a model costing
+// SPRT_MODEL_COST match checks to fit.
+#define SPRT_MODEL_COST 200
+#define SPRT_EPSILON .1
+#define SPRT_DELTA .01
+
+typedef struct
+{
+    double epsilon, delta, A;
+    long rejected_inliers, rejected_checks; // over the rejected hypotheses
+} sprt_test;
+
+static void sprt_update(sprt_test *t, double epsilon, double delta)
+{
+    t->epsilon = epsilon;
+    t->delta = delta;
+    t->A = 0;
+    if (delta >= epsilon)
+        return;
+    double C = (1 - delta) * log((1 - delta) / (1 - epsilon)) + delta * log(delta / epsilon);
+    double A0 = SPRT_MODEL_COST * C + 1, A = A0;
+    for (int i = 0; i < 10; ++i)
+        A = A0 + log(A);
+    t->A = A;
+}
+
+// Counts h's inliers like count_inliers, from a random start so the order of
+// m does not bias the test, stopping early when the SPRT rejects h.
+// long *checked: incremented by the number of matches projected.
+// returns: the number of inliers, or -1 if h was rejected.
+static int count_inliers_sprt(const double *h, const match *m, int n, float thresh, sprt_test *t, long *checked)
+{
+    float thresh2 = thresh * thresh;
+    double inlier = t->delta / t->epsilon, outlier = (1 - t->delta) / (1 - t->epsilon), lambda = 1;
+    int start = get_random_number(0, n - 1), count = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const match *mi = m + (start + i < n ? start + i : start + i - n);
+        point p = project_homography(h, mi->p);
+        float dx = p.x - mi->q.x, dy = p.y - mi->q.y;
+        int in = dx * dx + dy * dy < thresh2;
+        count += in;
+        lambda *= in ? inlier : outlier;
+        if (lambda > t->A)
+        {
+            *checked += i + 1;
+            t->rejected_inliers += count;
+            t->rejected_checks += i + 1;
+            return -1;
+        }
+    }
+    *checked += n;
+    return count;
+}
+
+// Iterations needed to draw an all-inlier sample with this confidence when a
+// w share of the matches are inliers and good models survive the SPRT with
+// probability 1 - 1/A (A = 0 without it), capped at k.
+static int ransac_iterations(double confidence, double w, double A, int k)
+{
+    if (confidence <= 0 || confidence >= 1)
+        return k;
+    double good = w * w * w * w * (A > 0 ? 1 - 1 / A : 1);
+    if (good >= 1)
+        return 1;
+    if (good <= 0)
+        return k;
+    double need = ceil(log(1 - confidence) / log(1 - good));
+    return need < k ? (int)need : k;
+}
+
+// Draws count distinct indices below n.
+static void ransac_sample(int n, int *idx, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        int j;
+        do
+        {
+            idx[i] = get_random_number(0, n - 1);
+            for (j = 0; j < i && idx[j] != idx[i]; ++j)
+                ;
+        } while (j < i);
+    }
+}
+
+// PROSAC after Chum and Matas: samples come from the n best-ranked matches,
+// with n growing from 4 to all of them over about k iterations at the rate
+// that, on average, draws each 4-subset no earlier than uniform sampling
+// would draw it. Until a subset size's share of iterations is used up, each
+// sample includes the newest match, match n - 1.
+typedef struct
+{
+    int n, N;    // prefix sampled from, of N matches
+    double Tn;   // expected uniform draws, out of k, landing in the prefix
+    int Tn_next; // iteration at which the prefix grows
+    int t;       // iterations drawn
+} prosac_sampler;
+
+static prosac_sampler make_prosac_sampler(int N, int k)
+{
+    prosac_sampler p = {4, N, k, 1, 0};
+    for (int i = 0; i < 4 && N >= 4; ++i)
+        p.Tn *= (4.0 - i) / (N - i);
+    return p;
+}
+
+static void prosac_sample(prosac_sampler *p, int *idx)
+{
+    if (++p->t > p->Tn_next && p->n < p->N)
+    {
+        double next = p->Tn * (p->n + 1) / (p->n + 1 - 4);
+        p->Tn_next += (int)ceil(next - p->Tn);
+        p->Tn = next;
+        ++p->n;
+    }
+    if (p->Tn_next < p->t)
+    {
+        ransac_sample(p->n, idx, 4);
+    }
+    else
+    {
+        ransac_sample(p->n - 1, idx, 3);
+        idx[3] = p->n - 1;
+    }
+}
+
+// PROSAC's stopping rule, for the best homography h so far: PROSAC can stop
+// once, for some prefix of the matches at least as long as the one it samples
+// from, it has drawn enough samples there to have found an all-inlier one
+// with the given confidence, and h's support in that prefix is more than a wrong
+// model would get by chance (each match agreeing with probability beta, to
+// 95%). Fills kmin[i] with the fewest iterations that satisfy this for some
+// prefix longer than i, k where none does.
+static void prosac_stopping(const double *h, const match *m, int n, float thresh, double confidence, double beta,
+                            double A, int k, int *kmin)
+{
+    float thresh2 = thresh * thresh;
+    int inliers = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        point p = project_homography(h, m[i].p);
+        float dx = p.x - m[i].q.x, dy = p.y - m[i].q.y;
+        inliers += dx * dx + dy * dy < thresh2;
+        int size = i + 1;
+        double chance = (size - 4) * beta;
+        kmin[i] = k;
+        if (size > 4 && inliers > 4 + chance + 1.645 * sqrt(chance * (1 - beta)))
+            kmin[i] = ransac_iterations(confidence, (double)inliers / size, A, k);
+    }
+    for (int i = n - 2; i >= 0; --i)
+        kmin[i] = MIN(kmin[i], kmin[i + 1]);
 }
 
 // Perform RANdom SAmple Consensus to calculate homography for noisy matches.
+// Each iteration draws four matches by index, solves for their homography on
+// the stack and counts its inliers in place, so the loop neither moves the
+// matches nor allocates.
 // match *m: set of matches.
 // int n: number of matches.
 // float thresh: inlier/outlier distance threshold.
@@ -348,44 +1425,164 @@ matrix compute_homography(match *matches, int n)
 // returns: matrix representing most common homography between matches.
 matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
 {
-    int e;
-    int best = 0;
-    matrix Hb = make_translation_homography(256, 0);
+    return RANSAC_ex(m, n, thresh, k, cutoff, 0, 0);
+}
 
-    int num_points_to_fit = 4; // rule of thumb for fitting homography matrices
+// Same as RANSAC, drawing samples as sampler says.
+matrix RANSAC_sampler(match *m, int n, float thresh, int k, int cutoff, ransac_sampler sampler)
+{
+    panorama_options opt = {0};
+    opt.sampler = sampler;
+    return RANSAC_ex(m, n, thresh, k, cutoff, &opt, 0);
+}
 
-    for (int i = 0; i < k; ++i)
+// Same as RANSAC with the settings in opt: drawing samples as sampler says,
+// stopping before k once ransac_confidence is met (by PROSAC's rule too with
+// SAMPLE_PROSAC) and, with ransac_sprt, giving up scoring hypotheses the SPRT
+// rejects.
+// const panorama_options *opt: null for the defaults.
+// ransac_stats *stats: null, or filled in with what the call did.
+matrix RANSAC_ex(match *m, int n, float thresh, int k, int cutoff, const panorama_options *opt,
+                 ransac_stats *stats)
+{
+    static const panorama_options defaults;
+    opt = opt ? opt : &defaults;
+    ransac_sampler sampler = opt->sampler;
+    double confidence = opt->ransac_confidence;
+    int use_sprt = opt->ransac_sprt;
+    int best = 0;
+    double hb[9], h[9];
+    int idx[4];
+    ransac_stats run = {0, 0, 0};
+    prosac_sampler prosac = make_prosac_sampler(n, k);
+    int *kmin = 0;
+    if (sampler == SAMPLE_PROSAC && n >= 4)
     {
-        randomize_matches(m, n);
-
-        match *m_sliced = calloc(num_points_to_fit, sizeof(match));
+        kmin = malloc(n * sizeof(int));
+        for (int i = 0; i < n; ++i)
+            kmin[i] = k;
+    }
+    sprt_test sprt = {0};
+    sprt_update(&sprt, SPRT_EPSILON, SPRT_DELTA);
+    int limit = k;
 
-        for (int j = 0; j < num_points_to_fit; ++j)
+    for (int i = 0; i < limit && n >= 4; ++i)
+    {
+        if (kmin && i >= kmin[prosac.n - 1])
+            break;
+        ++run.iterations;
+        if (sampler == SAMPLE_PROSAC)
+            prosac_sample(&prosac, idx);
+        else
+            ransac_sample(n, idx, 4);
+        if (!solve_homography4(m, idx, h))
+            continue;
+        int num_inliers;
+        if (use_sprt && sprt.A > 0)
         {
-            m_sliced[j] = m[j];
+            num_inliers = count_inliers_sprt(h, m, n, thresh, &sprt, &run.checks);
+            if (num_inliers < 0)
+            {
+                // Re-estimate delta from the rejected hypotheses once it has
+                // moved by more than 5%.
+                double delta = (double)sprt.rejected_inliers / sprt.rejected_checks;
+                delta = delta < SPRT_DELTA ? SPRT_DELTA : delta;
+                if (fabs(delta - sprt.delta) > .05 * sprt.delta)
+                {
+                    sprt_update(&sprt, sprt.epsilon, delta);
+                    limit = ransac_iterations(confidence, (double)best / n, sprt.A, k);
+                }
+                continue;
+            }
+        }
+        else
+        {
+            num_inliers = count_inliers(h, m, n, thresh);
+            run.checks += n;
         }
-
-        matrix predicted_homography = compute_homography(m_sliced, num_points_to_fit);
-        int num_inliers = model_inliers(predicted_homography, m, n, thresh);
-
         if (num_inliers > best)
         {
-
+            best = num_inliers;
+            run.best_iteration = run.iterations;
+            memcpy(hb, h, sizeof(hb));
             if (num_inliers > cutoff)
+                break;
+            if ((double)best / n > sprt.epsilon)
+                sprt_update(&sprt, (double)best / n, sprt.delta);
+            limit = ransac_iterations(confidence, (double)best / n, use_sprt ? sprt.A : 0, k);
+            if (kmin)
             {
-                free(m_sliced);
-                return predicted_homography;
+                prosac_stopping(hb, m, n, thresh, confidence, sprt.delta, use_sprt ? sprt.A : 0, k, kmin);
+                run.checks += n;
             }
-
-            best = num_inliers;
-            free_matrix(Hb);
-            Hb = copy_matrix(predicted_homography);
         }
     }
-
+    if (stats)
+        *stats = run;
+    free(kmin);
+
+    if (!best)
+        return make_translation_homography(256, 0);
+    matrix Hb = make_matrix(3, 3);
+    for (int i = 0; i < 9; ++i)
+        Hb.data[i / 3][i % 3] = hb[i];
     return Hb;
 }
 
+// Image b warped onto canvas c, shared by the threads doing the warp.
+typedef struct
+{
+    image b, c;
+    matrix H;
+    int dx, dy;
+    int fill;           // 0 leaves canvas pixels that land outside b untouched
+    border_mode border; // what those read when fill is set
+} warp_job;
+
+// Warps canvas rows [j0, j1): every canvas pixel that lands inside image b
+// under H takes b's bilinearly interpolated value, and with fill set so does
+// every other one, reading past b's edges through the border mode. The
+// projection is the same arithmetic as project_point, without its per-pixel
+// matrix allocations.
+static void warp_rows(void *ctx, int j0, int j1)
+{
+    warp_job *job = ctx;
+    image b = job->b, c = job->c;
+    double **h = job->H.data;
+
+    for (int j = j0; j < j1; ++j)
+    {
+        for (int i = 0; i < c.w; ++i)
+        {
+            double x = i + job->dx, y = j + job->dy;
+            float factor = h[2][0] * x + h[2][1] * y + h[2][2];
+            point pb = make_point(0, 0);
+            if (factor != 0)
+            {
+                pb = make_point((h[0][0] * x + h[0][1] * y + h[0][2]) / factor,
+                                (h[1][0] * x + h[1][1] * y + h[1][2]) / factor);
+            }
+
+            if (pb.x >= 0 && pb.x < b.w - 1 && pb.y >= 0 && pb.y < b.h - 1)
+            {
+                for (int k = 0; k < b.c; ++k)
+                {
+                    float val = bilinear_interpolate(b, pb.x, pb.y, k);
+                    set_pixel(c, i, j, k, val);
+                }
+            }
+            else if (job->fill)
+            {
+                for (int k = 0; k < b.c; ++k)
+                {
+                    float val = bilinear_interpolate_border(b, pb.x, pb.y, k, job->border);
+                    set_pixel(c, i, j, k, val);
+                }
+            }
+        }
+    }
+}
+
 // Stitches two images together using a projective transformation.
 // image a, b: images to stitch.
 // matrix H: homography from image a coordinates to image b coordinates.
@@ -399,6 +1596,7 @@ image combine_images(image a, image b, matrix H)
     point c2 = project_point(Hinv, make_point(b.w - 1, 0));
     point c3 = project_point(Hinv, make_point(0, b.h - 1));
     point c4 = project_point(Hinv, make_point(b.w - 1, b.h - 1));
+    free_matrix(Hinv);
 
     // Find top left and bottom right corners of image b warped into image a.
     point topleft, botright;
@@ -418,40 +1616,25 @@ image combine_images(image a, image b, matrix H)
         return copy_image(a);
     }
 
-    int i, j, k;
     image c = make_image(w, h, a.c);
 
     // Paste image a into the new image offset by dx and dy.
-    for (k = 0; k < a.c; ++k)
-    {
-        for (j = 0; j < a.h; ++j)
-        {
-            for (i = 0; i < a.w; ++i)
-            {
-                set_pixel(c, i - dx, j - dy, k, get_pixel(a, i, j, k));
-            }
-        }
-    }
-
-    for (j = 0; j < c.h; ++j)
-    {
-        for (i = 0; i < c.w; ++i)
-        {
-
-            point p = make_point(i + dx, j + dy);
+    paste_strided_image(image_view(c, -dx, -dy, a.w, a.h), image_as_strided(a));
 
-            point pb = project_point(H, p);
+    warp_job job = {b, c, H, dx, dy, 0, BORDER_CLAMP};
+    parallel_for(c.h, 4, warp_rows, &job);
+    return c;
+}
 
-            if (pb.x >= 0 && pb.x < b.w - 1 && pb.y >= 0 && pb.y < b.h - 1)
-            {
-                for (k = 0; k < b.c; ++k)
-                {
-                    float val = bilinear_interpolate(b, pb.x, pb.y, k);
-                    set_pixel(c, i, j, k, val);
-                }
-            }
-        }
-    }
+// Warps an image onto a new w x h canvas. Canvas pixel p takes the bilinearly
+// interpolated value of im at H p; where that falls outside im, the border
+// mode decides what is read (BORDER_ZERO leaves it black).
+// matrix H: homography from canvas coordinates to image coordinates.
+image warp_image(image im, matrix H, int w, int h, border_mode border)
+{
+    image c = make_image(w, h, im.c);
+    warp_job job = {im, c, H, 0, 0, 1, border};
+    parallel_for(c.h, 4, warp_rows, &job);
     return c;
 }
 
@@ -464,6 +1647,25 @@ image combine_images(image a, image b, matrix H)
 // int iters: number of RANSAC iterations. Typical: 1,000-50,000
 // int cutoff: RANSAC inlier cutoff. Typical: 10-100
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
+{
+    return panorama_image_ex(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff, 0);
+}
+
+// Same as panorama_image, with RANSAC drawing samples as sampler says.
+// SAMPLE_PROSAC tries the closest descriptor matches first.
+image panorama_image_sampler(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters,
+                             int cutoff, ransac_sampler sampler)
+{
+    panorama_options opt = {0};
+    opt.sampler = sampler;
+    return panorama_image_ex(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff, &opt);
+}
+
+// Same as panorama_image, detecting, matching and running RANSAC with the
+// settings in opt.
+// const panorama_options *opt: null for the defaults.
+image panorama_image_ex(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters,
+                        int cutoff, const panorama_options *opt)
 {
 
     printf("i have begun the panoroma");
@@ -471,22 +1673,20 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     assert(b.data != NULL);
 
     srand(10);
-    int an = 0;
-    int bn = 0;
     int mn = 0;
 
     // Calculate corners and descriptors
-    descriptor *ad = harris_corner_detector(a, sigma, thresh, nms, &an);
-    descriptor *bd = harris_corner_detector(b, sigma, thresh, nms, &bn);
+    descriptor_set ad = harris_descriptor_set_ex(image_as_strided(a), sigma, thresh, nms, opt);
+    descriptor_set bd = harris_descriptor_set_ex(image_as_strided(b), sigma, thresh, nms, opt);
 
-    if (!ad || !bd)
+    if (!ad.x || !bd.x)
     {
         fprintf(stderr, "Descriptor generation failed.\n");
         return make_image(1, 1, 1); // or appropriate error handling
     }
 
     // Find matches
-    match *m = match_descriptors(ad, an, bd, bn, &mn);
+    match *m = match_descriptor_sets_ex(ad, bd, &mn, opt);
 
     if (!m || mn == 0)
     {
@@ -495,22 +1695,24 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
     }
 
     // Run RANSAC to find the homography
-    matrix H = RANSAC(m, mn, inlier_thresh, iters, cutoff);
+    matrix H = RANSAC_ex(m, mn, inlier_thresh, iters, cutoff, opt, 0);
 
     if (1)
     {
         // Mark corners and matches between images
-        mark_corners(a, ad, an);
-        mark_corners(b, bd, bn);
+        mark_descriptor_set(a, ad);
+        mark_descriptor_set(b, bd);
         image inlier_matches = draw_inliers(a, b, H, m, mn, inlier_thresh);
         save_image(inlier_matches, "inliers");
+        free_image(inlier_matches);
     }
 
-    free_descriptors(ad, an);
-    free_descriptors(bd, bn);
+    free_descriptor_set(ad);
+    free_descriptor_set(bd);
     free(m);
 
     // Stitch the images together with the homography
     image comb = combine_images(a, b, H);
+    free_matrix(H);
     return comb;
 }
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "image.h"
+#include "parallel.h"
+
+// A persistent pool of worker threads. The calling thread always takes part,
+// so a pool of n threads has n - 1 workers.
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    pthread_mutex_t job_lock; // one parallel_for at a time
+    pthread_t *workers;
+    int num_workers;
+    int num_threads; // 0 until first use; written under job_lock, read atomically
+
+    parallel_fn fn;
+    void *ctx;
+    int n, grain, chunks;
+    int next_chunk;
+    int busy; // workers still inside the current job
+    unsigned generation;
+    int quit;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+
+static __thread int inside_parallel_for = 0;
+
+static int default_num_threads()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#endif
+}
+
+// Claims chunks of the current job until none are left. Called with the
+// pool lock held and returns with it held.
+static void run_chunks()
+{
+    while (pool.next_chunk < pool.chunks)
+    {
+        int chunk = pool.next_chunk++;
+        int start = chunk * pool.grain;
+        int end = MIN(start + pool.grain, pool.n);
+        pthread_mutex_unlock(&pool.lock);
+        pool.fn(pool.ctx, start, end);
+        pthread_mutex_lock(&pool.lock);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    (void)arg;
+    inside_parallel_for = 1;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    while (1)
+    {
+        while (pool.generation == seen && !pool.quit)
+            pthread_cond_wait(&pool.work_ready, &pool.lock);
+        if (pool.quit)
+            break;
+        seen = pool.generation;
+        run_chunks();
+        if (--pool.busy == 0)
+            pthread_cond_signal(&pool.work_done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+static void stop_workers()
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.num_workers; ++i)
+        pthread_join(pool.workers[i], 0);
+    free(pool.workers);
+    pool.workers = 0;
+    pool.num_workers = 0;
+    pool.quit = 0;
+}
+
+static void start_workers(int n)
+{
+    pool.workers = calloc(n, sizeof(pthread_t));
+    for (int i = 0; i < n - 1; ++i)
+    {
+        if (pthread_create(&pool.workers[i], 0, worker_main, 0))
+        {
+            fprintf(stderr, "Failed to start worker thread, using %d threads.\n", i + 1);
+            n = i + 1;
+            break;
+        }
+        pool.num_workers = i + 1;
+    }
+    __atomic_store_n(&pool.num_threads, n, __ATOMIC_RELEASE);
+}
+
+// Sets how many threads the image operations use, including the caller.
+// int n: number of threads, 0 or less picks the number of online cores.
+// returns: 1, or 0 if called from inside a parallel_for job, which still
+//          holds the pool; the thread count is left alone then.
+int uwimg_set_num_threads(int n)
+{
+    if (inside_parallel_for)
+        return 0;
+    if (n <= 0)
+        n = default_num_threads();
+    pthread_mutex_lock(&pool.job_lock);
+    if (n != pool.num_threads)
+    {
+        stop_workers();
+        start_workers(n);
+    }
+    pthread_mutex_unlock(&pool.job_lock);
+    return 1;
+}
+
+int uwimg_get_num_threads()
+{
+    int n = __atomic_load_n(&pool.num_threads, __ATOMIC_ACQUIRE);
+    if (!n)
+    {
+        uwimg_set_num_threads(0);
+        n = __atomic_load_n(&pool.num_threads, __ATOMIC_ACQUIRE);
+    }
+    return n;
+}
+
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx)
+{
+    if (n <= 0)
+        return;
+    int threads = uwimg_get_num_threads();
+    if (grain < 1)
+        grain = 1;
+    int chunks = (n + grain - 1) / grain;
+    if (threads == 1 || chunks <= 1 || inside_parallel_for)
+    {
+        // Same chunks as the threaded path: with -Ofast a vectorized loop can
+        // round its tail differently, so the split must not depend on threads.
+        for (int start = 0; start < n; start += grain)
+            fn(ctx, start, MIN(start + grain, n));
+        return;
+    }
+
+    pthread_mutex_lock(&pool.job_lock);
+    inside_parallel_for = 1;
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.n = n;
+    pool.grain = grain;
+    pool.chunks = chunks;
+    pool.next_chunk = 0;
+    pool.busy = pool.num_workers;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.work_ready);
+
+    run_chunks();
+    while (pool.busy > 0)
+        pthread_cond_wait(&pool.work_done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    inside_parallel_for = 0;
+    pthread_mutex_unlock(&pool.job_lock);
+}
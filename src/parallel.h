@@ -0,0 +1,14 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// A range of work items [start, end) handed to one thread.
+typedef void (*parallel_fn)(void *ctx, int start, int end);
+
+// Splits [0, n) into chunks of grain items and runs fn on them across the
+// thread pool, returning when all are done. The chunks only depend on n and
+// grain, so callers that write disjoint outputs per item get bit-identical
+// results whatever the thread count. Nested calls run serially.
+// int grain: items per chunk, large enough to be worth a thread hand-off.
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx);
+
+#endif
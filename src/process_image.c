@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <math.h>
 #include "image.h"
+#include "parallel.h"
 #include <stdlib.h>
 
 float RGB_WEIGHTS[3] = {0.299, 0.587, 0.114};
@@ -19,6 +20,41 @@ float get_pixel(image im, int x, int y, int c)
     return im.data[c * im.w * im.h + y * im.w + x];
 }
 
+// Maps coordinate i along an axis of n pixels into [0, n) under a border mode.
+// returns: the coordinate to read, or -1 if the read is a BORDER_ZERO zero.
+int border_coord(int i, int n, border_mode border)
+{
+    if (i >= 0 && i < n)
+        return i;
+    switch (border)
+    {
+    case BORDER_ZERO:
+        return -1;
+    case BORDER_REFLECT:
+    {
+        if (n == 1)
+            return 0;
+        int period = 2 * (n - 1);
+        i = ((i % period) + period) % period;
+        return i < n ? i : period - i;
+    }
+    case BORDER_WRAP:
+        return ((i % n) + n) % n;
+    default:
+        return i < 0 ? 0 : n - 1;
+    }
+}
+
+// Same as get_pixel, with reads outside the image following a border mode.
+float get_pixel_border(image im, int x, int y, int c, border_mode border)
+{
+    x = border_coord(x, im.w, border);
+    y = border_coord(y, im.h, border);
+    if (x < 0 || y < 0)
+        return 0;
+    return im.data[c * im.w * im.h + y * im.w + x];
+}
+
 void set_pixel(image im, int x, int y, int c, float v)
 {
     if (x >= 0 && x < im.w && y >= 0 && y < im.h)
@@ -30,19 +66,10 @@ void set_pixel(image im, int x, int y, int c, float v)
 image copy_image(image im)
 {
     image copy = make_image(im.w, im.h, im.c);
-    copy.w = im.w;
-    copy.h = im.h;
-    copy.c = im.c;
-
-    int num_elements = im.w * im.h * im.c;
-    copy.data = (float *)(malloc(num_elements * sizeof(float)));
 
     if (copy.data != NULL)
     {
-        for (int i = 0; i < num_elements; ++i)
-        {
-            copy.data[i] = im.data[i];
-        }
+        memcpy(copy.data, im.data, im.w * im.h * im.c * sizeof(float));
     }
     else
     {
@@ -52,33 +79,122 @@ image copy_image(image im)
     return copy;
 }
 
+// Wraps a packed image as a strided one without copying.
+strided_image image_as_strided(image im)
+{
+    strided_image s = {im.w, im.h, im.c, im.w, (long)im.w * im.h, im.data};
+    return s;
+}
+
+// Copies an image into a new padded, aligned strided image.
+strided_image to_strided_image(image im)
+{
+    strided_image s = make_strided_image(im.w, im.h, im.c);
+    paste_strided_image(s, image_as_strided(im));
+    return s;
+}
+
+// Copies a strided image or view back into a new packed image.
+image from_strided_image(strided_image s)
+{
+    image im = make_image(s.w, s.h, s.c);
+    paste_strided_image(image_as_strided(im), s);
+    return im;
+}
+
+// Makes a view of the w x h rectangle at (x, y) of an image. The view shares
+// the image's buffer, so nothing is copied and writes go to the parent. It
+// must not outlive the parent or be passed to free_strided_image.
+strided_image image_view(image im, int x, int y, int w, int h)
+{
+    return strided_view(image_as_strided(im), x, y, w, h);
+}
+
+// Same as image_view for a strided image or another view.
+strided_image strided_view(strided_image im, int x, int y, int w, int h)
+{
+    assert(x >= 0 && y >= 0 && w > 0 && h > 0 && x + w <= im.w && y + h <= im.h);
+    strided_image v = im;
+    v.w = w;
+    v.h = h;
+    v.data = strided_row(im, 0, y) + x;
+    return v;
+}
+
+// Copies src into dst, which must be the same size, row by row. With a view
+// as dst this pastes src into part of a larger image.
+void paste_strided_image(strided_image dst, strided_image src)
+{
+    assert(dst.w == src.w && dst.h == src.h && dst.c >= src.c);
+    for (int ch = 0; ch < src.c; ++ch)
+    {
+        for (int y = 0; y < src.h; ++y)
+        {
+            memcpy(strided_row(dst, ch, y), strided_row(src, ch, y), src.w * sizeof(float));
+        }
+    }
+}
+
+// Source and destination of a per-pixel conversion, shared by the threads
+// working on it.
+typedef struct
+{
+    image src, dst;
+} pixel_job;
+
+static void rgb_to_grayscale_pixels(void *ctx, int start, int end)
+{
+    pixel_job *job = ctx;
+    int plane = job->src.w * job->src.h;
+    const float *r = job->src.data, *g = r + plane, *b = g + plane;
+    for (int i = start; i < end; ++i)
+    {
+        job->dst.data[i] = RGB_WEIGHTS[0] * r[i] + RGB_WEIGHTS[1] * g[i] + RGB_WEIGHTS[2] * b[i];
+    }
+}
+
 image rgb_to_grayscale(image im)
 {
     assert(im.c == 3);
     image gray = make_image(im.w, im.h, 1);
 
     int num_pixels = gray.w * gray.h;
-    gray.data = (float *)(malloc(num_pixels * sizeof(float)));
 
     if (gray.data != NULL)
     {
+        pixel_job job = {im, gray};
+        parallel_for(num_pixels, 4096, rgb_to_grayscale_pixels, &job);
+    }
 
-        for (int y = 0; y < gray.h; ++y)
-        {
-            for (int x = 0; x < gray.w; ++x)
-            {
-                float gray_val = 0;
+    return gray;
+}
 
-                for (int c = 0; c < im.c; ++c)
-                {
-                    gray_val += RGB_WEIGHTS[c] * get_pixel(im, x, y, c);
-                }
-                set_pixel(gray, x, y, 0, gray_val);
-            }
+// Source and destination of a row-parallel conversion between strided images.
+typedef struct
+{
+    strided_image src, dst;
+} strided_job;
+
+static void rgb_to_grayscale_rows(void *ctx, int y0, int y1)
+{
+    strided_job *job = ctx;
+    for (int y = y0; y < y1; ++y)
+    {
+        const float *r = strided_row(job->src, 0, y), *g = strided_row(job->src, 1, y), *b = strided_row(job->src, 2, y);
+        float *out = strided_row(job->dst, 0, y);
+        for (int x = 0; x < job->src.w; ++x)
+        {
+            out[x] = RGB_WEIGHTS[0] * r[x] + RGB_WEIGHTS[1] * g[x] + RGB_WEIGHTS[2] * b[x];
         }
     }
+}
 
-    return gray;
+strided_image rgb_to_grayscale_strided(strided_image im)
+{
+    assert(im.c == 3);
+    strided_job job = {im, make_strided_image(im.w, im.h, 1)};
+    parallel_for(im.h, 16, rgb_to_grayscale_rows, &job);
+    return job.dst;
 }
 
 void shift_image(image im, int c, float v)
@@ -116,21 +232,10 @@ float three_way_min(float a, float b, float c)
     return (a < b) ? ((a < c) ? a : c) : ((b < c) ? b : c);
 }
 
-void rgb_to_hsv(image im)
+// Converts n pixels in place, given where they start in each channel.
+static void rgb_to_hsv_span(float *r_channel_start, float *g_channel_start, float *b_channel_start, int n)
 {
-
-    if (im.c != 3)
-    {
-        return;
-    }
-
-    int num_pixels = im.w * im.h;
-
-    float *r_channel_start = im.data;
-    float *g_channel_start = im.data + num_pixels;
-    float *b_channel_start = im.data + 2 * num_pixels;
-
-    for (int i = 0; i < num_pixels; ++i)
+    for (int i = 0; i < n; ++i)
     {
 
         float value = three_way_max(r_channel_start[i], g_channel_start[i], b_channel_start[i]);
@@ -170,20 +275,36 @@ void rgb_to_hsv(image im)
     }
 }
 
-void hsv_to_rgb(image im)
+static void rgb_to_hsv_rows(void *ctx, int y0, int y1)
+{
+    strided_image im = ((strided_job *)ctx)->src;
+    for (int y = y0; y < y1; ++y)
+    {
+        rgb_to_hsv_span(strided_row(im, 0, y), strided_row(im, 1, y), strided_row(im, 2, y), im.w);
+    }
+}
+
+void rgb_to_hsv(image im)
 {
+    rgb_to_hsv_strided(image_as_strided(im));
+}
+
+// Same as rgb_to_hsv on a strided image or view, in place.
+void rgb_to_hsv_strided(strided_image im)
+{
+
     if (im.c != 3)
     {
         return;
     }
 
-    int num_pixels = im.w * im.h;
-
-    float *h_channel_start = im.data;
-    float *s_channel_start = im.data + num_pixels;
-    float *v_channel_start = im.data + 2 * num_pixels;
+    strided_job job = {im, im};
+    parallel_for(im.h, 16, rgb_to_hsv_rows, &job);
+}
 
-    for (int i = 0; i < num_pixels; ++i)
+static void hsv_to_rgb_span(float *h_channel_start, float *s_channel_start, float *v_channel_start, int n)
+{
+    for (int i = 0; i < n; ++i)
     {
         float h = h_channel_start[i];
         float s = s_channel_start[i];
@@ -247,3 +368,29 @@ void hsv_to_rgb(image im)
         v_channel_start[i] = b;
     }
 }
+
+static void hsv_to_rgb_rows(void *ctx, int y0, int y1)
+{
+    strided_image im = ((strided_job *)ctx)->src;
+    for (int y = y0; y < y1; ++y)
+    {
+        hsv_to_rgb_span(strided_row(im, 0, y), strided_row(im, 1, y), strided_row(im, 2, y), im.w);
+    }
+}
+
+void hsv_to_rgb(image im)
+{
+    hsv_to_rgb_strided(image_as_strided(im));
+}
+
+// Same as hsv_to_rgb on a strided image or view, in place.
+void hsv_to_rgb_strided(strided_image im)
+{
+    if (im.c != 3)
+    {
+        return;
+    }
+
+    strided_job job = {im, im};
+    parallel_for(im.h, 16, hsv_to_rgb_rows, &job);
+}
@@ -1,5 +1,6 @@
 #include <math.h>
 #include "image.h"
+#include "parallel.h"
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
@@ -67,70 +68,163 @@ float bilinear_interpolate(image im, float x, float y, int c)
     return result_pixel;
 }
 
-image bilinear_resize(image im, int w, int h)
+// Reads x0 with weight lo and x1 with weight hi, for one output column or row.
+typedef struct
 {
+    int x0, x1;
+    float lo, hi;
+} resize_tap;
+
+// Maps output pixel i of a resize from n_in to n_out pixels back to the input.
+// Kept out of line so every resize rounds the same way: with -Ofast, a copy
+// inlined into a loop may turn the division into a reciprocal multiply and
+// give slightly different weights.
+static __attribute__((noinline)) float resize_source_coord(int i, int n_out, int n_in)
+{
+    float new_to_old_ratio = (float)n_out / n_in;
+    return i / new_to_old_ratio; // corresponding decimal form of the same old coord
+}
 
-    assert(w > 0 && h > 0);
-
-    image resized_image = make_image(w, h, im.c);
+// Builds the taps along one axis of a resize. The border mode only decides
+// where the right or bottom neighbour of the last pixel comes from, so the row
+// kernel never clamps or branches.
+static resize_tap *make_resize_taps(int n_out, int n_in, int nearest, border_mode border)
+{
+    resize_tap *taps = calloc(n_out, sizeof(resize_tap));
+    for (int i = 0; i < n_out; ++i)
+    {
+        float old_coord = resize_source_coord(i, n_out, n_in);
+        resize_tap t;
+        if (nearest)
+        {
+            int round = (int)(old_coord + 0.5);
+            t.x0 = t.x1 = round < n_in ? round : n_in - 1;
+            t.lo = 1;
+            t.hi = 0;
+        }
+        else
+        {
+            t.x0 = (int)floor(old_coord);
+            t.x1 = border_coord(t.x0 + 1, n_in, border);
+            float d = old_coord - t.x0;
+            t.lo = 1 - d;
+            t.hi = t.x1 < 0 ? 0 : d;
+            t.x1 = t.x1 < 0 ? t.x0 : t.x1;
+        }
+        taps[i] = t;
+    }
+    return taps;
+}
 
-    float new_to_old_ratio_w = (float)resized_image.w / im.w;
-    float new_to_old_ratio_h = (float)resized_image.h / im.h;
-    float predicted_pixel;
+// A resize shared by the threads working on it.
+typedef struct
+{
+    strided_image src, dst;
+    resize_tap *xt, *yt;
+    int nearest;
+} resize_job;
 
-    resized_image.data = (float *)(malloc(resized_image.c * resized_image.w * resized_image.h * sizeof(float)));
+// Fills output rows [j0, j1) of a resize.
+static void resize_rows(void *ctx, int j0, int j1)
+{
+    resize_job *job = ctx;
+    strided_image im = job->src, resized_image = job->dst;
+    const resize_tap *xt = job->xt;
 
-    for (int i = 0; i < resized_image.w; ++i)
+    for (int ch = 0; ch < resized_image.c; ++ch)
     {
-        for (int j = 0; j < resized_image.h; ++j)
+        for (int j = j0; j < j1; ++j)
         {
+            resize_tap yt = job->yt[j];
+            const float *r0 = strided_row(im, ch, yt.x0), *r1 = strided_row(im, ch, yt.x1);
+            float *row = strided_row(resized_image, ch, j);
 
-            float old_coord_x = i / new_to_old_ratio_w;
-            float old_coord_y = j / new_to_old_ratio_h;
-
-            for (int ch = 0; ch < resized_image.c; ++ch)
+            if (job->nearest)
             {
-
-                predicted_pixel = bilinear_interpolate(im, old_coord_x, old_coord_y, ch);
-
-                set_pixel(resized_image, i, j, ch, predicted_pixel);
+                for (int i = 0; i < resized_image.w; ++i)
+                    row[i] = r0[xt[i].x0];
+                continue;
+            }
+            for (int i = 0; i < resized_image.w; ++i)
+            {
+                resize_tap t = xt[i];
+                row[i] = t.lo * yt.lo * r0[t.x0] + t.hi * yt.lo * r0[t.x1] +
+                         t.lo * yt.hi * r1[t.x0] + t.hi * yt.hi * r1[t.x1];
             }
         }
     }
+}
 
-    return resized_image;
+// Resizes src into dst, which already has the target size.
+static void resize_strided(strided_image src, strided_image dst, int nearest, border_mode border)
+{
+    resize_job job = {src, dst, 0, 0, nearest};
+    job.xt = make_resize_taps(dst.w, src.w, nearest, border);
+    job.yt = make_resize_taps(dst.h, src.h, nearest, border);
+    parallel_for(dst.h, 8, resize_rows, &job);
+    free(job.xt);
+    free(job.yt);
 }
 
-image nn_resize(image im, int w, int h)
+// Same as bilinear_interpolate at any (x, y), with reads outside the image
+// following a border mode.
+float bilinear_interpolate_border(image im, float x, float y, int c, border_mode border)
+{
+    int x0 = (int)floor(x);
+    int y0 = (int)floor(y);
+    float dx = x - x0;
+    float dy = y - y0;
+
+    return (1 - dx) * (1 - dy) * get_pixel_border(im, x0, y0, c, border) +
+           dx * (1 - dy) * get_pixel_border(im, x0 + 1, y0, c, border) +
+           (1 - dx) * dy * get_pixel_border(im, x0, y0 + 1, c, border) +
+           dx * dy * get_pixel_border(im, x0 + 1, y0 + 1, c, border);
+}
+
+image bilinear_resize(image im, int w, int h)
+{
+    return bilinear_resize_border(im, w, h, BORDER_CLAMP);
+}
+
+// Same as bilinear_resize, with the neighbours past the last row and column
+// following a border mode.
+image bilinear_resize_border(image im, int w, int h, border_mode border)
 {
 
     assert(w > 0 && h > 0);
 
     image resized_image = make_image(w, h, im.c);
+    resize_strided(image_as_strided(im), image_as_strided(resized_image), 0, border);
 
-    float new_to_old_ratio_w = (float)resized_image.w / im.w;
-    float new_to_old_ratio_h = (float)resized_image.h / im.h;
-    float predicted_pixel;
-
-    resized_image.data = (float *)(malloc(resized_image.c * resized_image.w * resized_image.h * sizeof(float)));
+    return resized_image;
+}
 
-    for (int i = 0; i < resized_image.w; ++i)
-    {
-        for (int j = 0; j < resized_image.h; ++j)
-        {
+image nn_resize(image im, int w, int h)
+{
 
-            float old_coord_x = i / new_to_old_ratio_w; // corresponding decimal form of the same old coord
-            float old_coord_y = j / new_to_old_ratio_h;
+    assert(w > 0 && h > 0);
 
-            for (int ch = 0; ch < resized_image.c; ++ch)
-            {
+    image resized_image = make_image(w, h, im.c);
+    resize_strided(image_as_strided(im), image_as_strided(resized_image), 1, BORDER_CLAMP);
 
-                predicted_pixel = nn_interpolate(im, old_coord_x, old_coord_y, ch);
+    return resized_image;
+}
 
-                set_pixel(resized_image, i, j, ch, predicted_pixel);
-            }
-        }
-    }
+// Same as bilinear_resize for a strided image or view; the result is a new
+// padded, aligned strided image.
+strided_image bilinear_resize_strided(strided_image im, int w, int h)
+{
+    assert(w > 0 && h > 0);
+    strided_image resized_image = make_strided_image(w, h, im.c);
+    resize_strided(im, resized_image, 0, BORDER_CLAMP);
+    return resized_image;
+}
 
+// Same as nn_resize for a strided image or view.
+strided_image nn_resize_strided(strided_image im, int w, int h)
+{
+    assert(w > 0 && h > 0);
+    strided_image resized_image = make_strided_image(w, h, im.c);
+    resize_strided(im, resized_image, 1, BORDER_CLAMP);
     return resized_image;
 }
@@ -2,10 +2,12 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
 #include "matrix.h"
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "parallel.h"
 
 void feature_normalize2(image im)
 {
@@ -44,6 +46,10 @@ int same_image(image a, image b){
     return 1;
 }
 
+int identical_image(image a, image b){
+    return a.w == b.w && a.h == b.h && a.c == b.c && !memcmp(a.data, b.data, a.w*a.h*a.c*sizeof(float));
+}
+
 void test_get_pixel(){
     image im = load_image("data/dots.png");
     // Test within image
@@ -98,6 +104,181 @@ void test_copy()
     free_image(c);
 }
 
+void test_image_pool()
+{
+    image a = make_image(31, 17, 3);
+    a.data[5] = 1;
+    float *buffer = a.data;
+    free_image(a);
+
+    reset_image_pool_stats();
+    image b = make_image(17, 31, 3);
+    image_pool_stats stats = get_image_pool_stats();
+    TEST(stats.allocations == 1);
+    TEST(stats.reused == 1);
+    TEST(b.data == buffer);
+    TEST(within_eps(b.data[5], 0));
+
+    image c = make_image(17, 31, 3);
+    stats = get_image_pool_stats();
+    TEST(stats.reused == 1);
+    TEST(stats.peak_bytes >= 2*17*31*3*sizeof(float));
+    free_image(b);
+    free_image(c);
+    TEST(get_image_pool_stats().frees == 2);
+
+    // An RGBA load keeps its 4-channel buffer but reports 3 channels. Freeing
+    // it must hand back everything it took, filed under the size it really is.
+    reset_image_pool_stats();
+    size_t live = get_image_pool_stats().live_bytes;
+    image d = make_image(23, 19, 4);
+    float *rgba = d.data;
+    d.c = 3;
+    free_image(d);
+    TEST(get_image_pool_stats().live_bytes == live);
+    image e = make_image(23, 19, 3);
+    TEST(e.data != rgba);
+    image f = make_image(23, 19, 4);
+    TEST(f.data == rgba);
+    free_image(e);
+    free_image(f);
+}
+
+void test_strided_image()
+{
+    image im = load_image("data/dog.jpg");
+    strided_image s = to_strided_image(im);
+    TEST(s.stride % 16 == 0 && s.stride >= im.w);
+    TEST((size_t)strided_row(s, 2, 7) % 64 == 0);
+
+    image back = from_strided_image(s);
+    TEST(identical_image(back, im));
+
+    image f = make_gaussian_filter(1.5);
+    image big = make_random_image(21, 21, 1);
+    image sobel = make_gx_filter();
+    image filters[3] = {f, big, sobel};
+    int i;
+    for(i = 0; i < 3; ++i){
+        image c = convolve_image(im, filters[i], i != 2);
+        strided_image sc = convolve_strided_image(s, filters[i], i != 2);
+        image unpacked = from_strided_image(sc);
+        TEST(identical_image(c, unpacked));
+        free_image(c);
+        free_image(unpacked);
+        free_strided_image(sc);
+    }
+
+    image smooth = smooth_image(im, 4, 2);
+    strided_image ss = smooth_strided_image(s, 4, 2);
+    image unpacked = from_strided_image(ss);
+    TEST(identical_image(smooth, unpacked));
+    free_image(smooth);
+    free_image(unpacked);
+    free_strided_image(ss);
+
+    image gray = rgb_to_grayscale(im);
+    strided_image sg = rgb_to_grayscale_strided(s);
+    unpacked = from_strided_image(sg);
+    TEST(identical_image(gray, unpacked));
+    free_image(gray);
+    free_image(unpacked);
+    free_strided_image(sg);
+
+    free_image(f);
+    free_image(big);
+    free_image(sobel);
+    free_image(back);
+    free_strided_image(s);
+    free_image(im);
+}
+
+void test_image_view()
+{
+    image im = load_image("data/dog.jpg");
+    strided_image v = image_view(im, 50, 40, 200, 150);
+    image crop = from_strided_image(v);
+    TEST(within_eps(get_pixel(crop, 7, 9, 1), get_pixel(im, 57, 49, 1)));
+
+    image f = make_gaussian_filter(2);
+    image c = convolve_image(crop, f, 1);
+    strided_image vc = convolve_strided_image(v, f, 1);
+    image unpacked = from_strided_image(vc);
+    TEST(identical_image(c, unpacked));
+    free_image(c);
+    free_image(unpacked);
+    free_strided_image(vc);
+
+    image r = bilinear_resize(crop, 317, 211);
+    strided_image vr = bilinear_resize_strided(v, 317, 211);
+    unpacked = from_strided_image(vr);
+    TEST(identical_image(r, unpacked));
+    free_image(r);
+    free_image(unpacked);
+    free_strided_image(vr);
+
+    image hsv = copy_image(im);
+    image hsv_crop = copy_image(crop);
+    rgb_to_hsv_strided(image_view(hsv, 50, 40, 200, 150));
+    rgb_to_hsv(hsv_crop);
+    unpacked = from_strided_image(image_view(hsv, 50, 40, 200, 150));
+    TEST(identical_image(hsv_crop, unpacked));
+    TEST(get_pixel(hsv, 10, 10, 2) == get_pixel(im, 10, 10, 2));
+    free_image(hsv);
+    free_image(hsv_crop);
+    free_image(unpacked);
+
+    int n = 0, vn = 0, same = 1, i;
+    descriptor *d = harris_corner_detector(crop, 2, 50, 3, &n);
+    descriptor *vd = harris_corner_detector_strided(v, 2, 50, 3, &vn);
+    TEST(n == vn && n > 0);
+    for(i = 0; i < n && i < vn; ++i){
+        same &= d[i].p.x == vd[i].p.x && d[i].p.y == vd[i].p.y;
+        same &= !memcmp(d[i].data, vd[i].data, d[i].n*sizeof(float));
+    }
+    TEST(same);
+    free_descriptors(d, n);
+    free_descriptors(vd, vn);
+
+    free_image(f);
+    free_image(crop);
+    free_image(im);
+}
+
+void test_u8_conversion(){
+    int channels[3] = {1, 3, 4};
+    int i, k;
+    for(k = 0; k < 3; ++k){
+        int c = channels[k], n = 37*5*c;
+        unsigned char *bytes = calloc(n, 1);
+        unsigned char *back = calloc(n, 1);
+        for(i = 0; i < n; ++i) bytes[i] = (i*97 + 13) % 256;
+        image im = u8_to_image(bytes, 37, 5, c);
+        int ok = 1;
+        for(i = 0; i < n; ++i){
+            ok &= im.data[(i % c)*37*5 + i/c] == bytes[i]*(1.0f/255);
+        }
+        TEST(ok);
+        image_to_u8(im, back);
+        TEST(!memcmp(bytes, back, n));
+        free(bytes);
+        free(back);
+        free_image(im);
+    }
+
+    // Out of range values clamp, the rest round half up.
+    image im = make_image(45, 1, 1);
+    float values[9] = {-.5, 1.5, .5/255, .49/255, 1, 0, .2, 128.7/255, 254.6/255};
+    unsigned char expected[9] = {0, 255, 1, 0, 255, 0, 51, 129, 255};
+    unsigned char bytes[45];
+    for(i = 0; i < 45; ++i) im.data[i] = values[i % 9];
+    image_to_u8(im, bytes);
+    int ok = 1;
+    for(i = 0; i < 45; ++i) ok &= bytes[i] == expected[i % 9];
+    TEST(ok);
+    free_image(im);
+}
+
 void test_shift()
 {
     image im = load_image("data/dog.jpg");
@@ -247,6 +428,175 @@ void test_convolution(){
     free_image(gt);
 }
 
+void test_separable_convolution(){
+    image im = load_image("data/dog.jpg");
+    image filters[] = {make_box_filter(7), make_gaussian_filter(3), make_gx_filter(), make_gy_filter(), make_emboss_filter()};
+    int i;
+    for(i = 0; i < 5; ++i){
+        image fast = convolve_image(im, filters[i], 1);
+        image full = convolve_image_direct(im, filters[i], 1);
+        TEST(same_image(fast, full));
+        free_image(fast);
+        free_image(full);
+
+        fast = convolve_image(im, filters[i], 0);
+        full = convolve_image_direct(im, filters[i], 0);
+        TEST(same_image(fast, full));
+        free_image(fast);
+        free_image(full);
+        free_image(filters[i]);
+    }
+    free_image(im);
+}
+
+void test_fft_path(){
+    image im = load_image("data/dog.jpg");
+    float sigmas[] = {3, 5, 10};
+    int i;
+
+    // Gaussians are 1-D or rank-1 at any size, so they never go via FFT,
+    // and smooth_image(..., 1) is exactly two direct 1-D passes.
+    int fft = 0, direct = 1;
+    for(i = 0; i < 3; ++i){
+        image row = make_1d_gaussian(sigmas[i], 1);
+        image col = make_1d_gaussian(sigmas[i], 0);
+        image g = make_gaussian_filter(sigmas[i]);
+        fft |= convolve_uses_fft(row) | convolve_uses_fft(col) | convolve_uses_fft(g);
+
+        image smooth = smooth_image(im, sigmas[i], 1);
+        image pass = convolve_image_direct(im, row, 1);
+        image both = convolve_image_direct(pass, col, 1);
+        direct &= !memcmp(smooth.data, both.data, im.w*im.h*im.c*sizeof(float));
+        free_image(smooth);
+        free_image(pass);
+        free_image(both);
+        free_image(row);
+        free_image(col);
+        free_image(g);
+    }
+    TEST(!fft);
+    TEST(direct);
+
+    // Non-separable filters switch by tap count.
+    image small = make_random_image(15, 15, 1), wide = make_random_image(41, 3, 1), large = make_random_image(25, 25, 1);
+    TEST(!convolve_uses_fft(small) && !convolve_uses_fft(wide) && convolve_uses_fft(large));
+
+    free_image(small);
+    free_image(wide);
+    free_image(large);
+    free_image(im);
+}
+
+void test_fft_convolution(){
+    image im = load_image("data/dog.jpg");
+    image f = make_image(15, 11, 1);
+    int i;
+    for(i = 0; i < f.w*f.h; ++i) f.data[i] = ((i*7919) % 23 - 11) / 100.;
+    image filters[] = {make_emboss_filter(), f};
+    int threshold = get_fft_convolve_threshold();
+    set_fft_convolve_threshold(1);
+    for(i = 0; i < 2; ++i){
+        image freq = convolve_image(im, filters[i], 1);
+        image full = convolve_image_direct(im, filters[i], 1);
+        TEST(same_image(freq, full));
+        free_image(freq);
+        free_image(full);
+
+        freq = convolve_image(im, filters[i], 0);
+        full = convolve_image_direct(im, filters[i], 0);
+        TEST(same_image(freq, full));
+        free_image(freq);
+        free_image(full);
+        free_image(filters[i]);
+    }
+
+    // Three 256x256 tiles across and one down, so the last pair of tiles is
+    // only half full.
+    image strip = make_image(600, 240, 1);
+    for(i = 0; i < strip.w*strip.h; ++i) strip.data[i] = (i*7919 % 101) / 100.;
+    f = make_image(15, 11, 1);
+    for(i = 0; i < f.w*f.h; ++i) f.data[i] = ((i*7919) % 23 - 11) / 100.;
+    image freq = convolve_image(strip, f, 1);
+    image full = convolve_image_direct(strip, f, 1);
+    TEST(same_image(freq, full));
+    free_image(freq);
+    free_image(full);
+    free_image(strip);
+    free_image(f);
+
+    set_fft_convolve_threshold(threshold);
+    free_image(im);
+}
+
+// Brute-force convolution reading every tap through get_pixel_border.
+image convolve_border_reference(image im, image f, border_mode border){
+    image out = make_image(im.w, im.h, im.c);
+    int x, y, c, fx, fy;
+    for(c = 0; c < im.c; ++c){
+        for(y = 0; y < im.h; ++y){
+            for(x = 0; x < im.w; ++x){
+                float sum = 0;
+                for(fy = 0; fy < f.h; ++fy){
+                    for(fx = 0; fx < f.w; ++fx){
+                        sum += f.data[fy*f.w + fx]*get_pixel_border(im, x + fx - f.w/2, y + fy - f.h/2, c, border);
+                    }
+                }
+                out.data[c*im.w*im.h + y*im.w + x] = sum;
+            }
+        }
+    }
+    return out;
+}
+
+void test_border_modes(){
+    TEST(border_coord(-2, 5, BORDER_CLAMP) == 0 && border_coord(6, 5, BORDER_CLAMP) == 4);
+    TEST(border_coord(-2, 5, BORDER_ZERO) == -1 && border_coord(3, 5, BORDER_ZERO) == 3);
+    TEST(border_coord(-2, 5, BORDER_REFLECT) == 2 && border_coord(6, 5, BORDER_REFLECT) == 2);
+    TEST(border_coord(-2, 5, BORDER_WRAP) == 3 && border_coord(6, 5, BORDER_WRAP) == 1);
+    TEST(border_coord(-13, 5, BORDER_REFLECT) == 3 && border_coord(-13, 5, BORDER_WRAP) == 2);
+
+    image im = make_random_image(37, 29, 2);
+    image small = make_random_image(5, 3, 1);
+    image box = make_box_filter(7);
+    image big = make_random_image(21, 21, 1);
+    image filters[3] = {small, box, big}; // direct, separable and FFT paths
+    int mode, i;
+    for(mode = BORDER_CLAMP; mode <= BORDER_WRAP; ++mode){
+        for(i = 0; i < 3; ++i){
+            image c = convolve_image_border(im, filters[i], 1, mode);
+            image gt = convolve_border_reference(im, filters[i], mode);
+            TEST(same_image(c, gt));
+            free_image(c);
+            free_image(gt);
+        }
+    }
+    image c = convolve_image_border(im, small, 1, BORDER_CLAMP);
+    image d = convolve_image(im, small, 1);
+    TEST(identical_image(c, d));
+    free_image(c);
+    free_image(d);
+
+    image r = bilinear_resize_border(im, 50, 40, BORDER_WRAP);
+    float x = 49 / (50 / 37.f), y = 39 / (40 / 29.f);
+    TEST(within_eps(get_pixel(r, 49, 39, 1), bilinear_interpolate_border(im, x, y, 1, BORDER_WRAP)));
+    free_image(r);
+
+    matrix H = make_translation_homography(10, -4);
+    image warped = warp_image(im, H, 37, 29, BORDER_WRAP);
+    TEST(within_eps(get_pixel(warped, 30, 2, 0), get_pixel(im, 3, 27, 0)));
+    free_image(warped);
+    warped = warp_image(im, H, 37, 29, BORDER_ZERO);
+    TEST(within_eps(get_pixel(warped, 30, 2, 0), 0));
+    TEST(within_eps(get_pixel(warped, 5, 10, 0), get_pixel(im, 15, 6, 0)));
+    free_image(warped);
+    free_matrix(H);
+
+    free_image(im);
+    free_image(small);
+    free_image(box);
+    free_image(big);
+}
+
 void test_gaussian_filter(){
     image f = make_gaussian_filter(7);
     int i;
@@ -275,6 +625,29 @@ void test_gaussian_blur(){
     free_image(gt);
 }
 
+void test_recursive_gaussian(){
+    image im = load_image("data/dog.jpg");
+    float sigmas[] = {2, 5, 30};
+    int i, j;
+    for(i = 0; i < 3; ++i){
+        image fir = smooth_image(im, sigmas[i], 1);
+        image iir = smooth_image(im, sigmas[i], 2);
+
+        float max_err = 0, mean_err = 0;
+        for(j = 0; j < im.w*im.h*im.c; ++j){
+            float err = fabs(fir.data[j] - iir.data[j]);
+            if(err > max_err) max_err = err;
+            mean_err += err;
+        }
+        mean_err /= im.w*im.h*im.c;
+        TEST(max_err < .05);
+        TEST(mean_err < .003);
+        free_image(fir);
+        free_image(iir);
+    }
+    free_image(im);
+}
+
 void test_hybrid_image(){
     image man = load_image("data/melisa.png");
     image woman = load_image("data/aria.png");
@@ -358,6 +731,738 @@ void test_sobel(){
     free(res);
 }
 
+void test_sobel_gradients(){
+    image im = load_image("data/dog.jpg");
+    image gx_filter = make_gx_filter();
+    image gy_filter = make_gy_filter();
+    image gx = convolve_image(im, gx_filter, 0);
+    image gy = convolve_image(im, gy_filter, 0);
+    image *exact = sobel_gradients(im, 0);
+    image *fast = sobel_gradients(im, 1);
+    image *mag_dir = sobel_image(im);
+
+    int i, n = im.w*im.h;
+    float grad_err = 0, dir_err = 0;
+    int same = 1;
+    for(i = 0; i < n; ++i){
+        grad_err = fmaxf(grad_err, fabsf(exact[0].data[i] - gx.data[i]));
+        grad_err = fmaxf(grad_err, fabsf(exact[1].data[i] - gy.data[i]));
+        float d = fabsf(fast[3].data[i] - exact[3].data[i]);
+        if(d > M_PI) d = 2*M_PI - d;
+        dir_err = fmaxf(dir_err, d);
+        same &= fast[2].data[i] == exact[2].data[i];
+        same &= mag_dir[0].data[i] == exact[2].data[i] && mag_dir[1].data[i] == exact[3].data[i];
+    }
+    TEST(grad_err < 1e-4);
+    TEST(dir_err < 2.1e-4);
+    TEST(same);
+
+    free_image(im);
+    free_image(gx_filter);
+    free_image(gy_filter);
+    free_image(gx);
+    free_image(gy);
+    for(i = 0; i < 4; ++i){
+        free_image(exact[i]);
+        free_image(fast[i]);
+    }
+    free_image(mag_dir[0]);
+    free_image(mag_dir[1]);
+    free(exact);
+    free(fast);
+    free(mag_dir);
+}
+
+// The structure matrix as it was built before fusing: Sobel on every
+// channel, grayscale of the gradients, then the products.
+image structure_matrix_reference(image im, float sigma)
+{
+    image gx_filter = make_gx_filter();
+    image gy_filter = make_gy_filter();
+    image gx = convolve_image(im, gx_filter, 1);
+    image gy = convolve_image(im, gy_filter, 1);
+    image ix = rgb_to_grayscale(gx);
+    image iy = rgb_to_grayscale(gy);
+    image S = make_image(im.w, im.h, 3);
+    int i, n = im.w*im.h;
+    for(i = 0; i < n; ++i){
+        S.data[i] = ix.data[i]*ix.data[i];
+        S.data[n + i] = iy.data[i]*iy.data[i];
+        S.data[2*n + i] = ix.data[i]*iy.data[i];
+    }
+    image smoothed = smooth_image(S, sigma, 1);
+    free_image(gx_filter);
+    free_image(gy_filter);
+    free_image(gx);
+    free_image(gy);
+    free_image(ix);
+    free_image(iy);
+    free_image(S);
+    return smoothed;
+}
+
+void test_fused_structure(){
+    image im = load_image("data/dog.jpg");
+    image ref = structure_matrix_reference(im, 2);
+    image S = structure_matrix(im, 2);
+    TEST(S.w == ref.w && S.h == ref.h && S.c == 3);
+
+    int i;
+    float err = 0, peak = 0;
+    for(i = 0; i < S.w*S.h*S.c; ++i){
+        err = fmaxf(err, fabsf(S.data[i] - ref.data[i]));
+        peak = fmaxf(peak, fabsf(ref.data[i]));
+    }
+    TEST(err <= 1e-5*peak);
+
+    // A single-channel input skips the grayscale step entirely.
+    image gray = rgb_to_grayscale(im);
+    image S1 = structure_matrix(gray, 2);
+    err = 0;
+    for(i = 0; i < S.w*S.h*S.c; ++i) err = fmaxf(err, fabsf(S1.data[i] - S.data[i]));
+    TEST(err <= 1e-5*peak);
+
+    free_image(im);
+    free_image(ref);
+    free_image(S);
+    free_image(gray);
+    free_image(S1);
+}
+
+// Non-max suppression by scanning the whole window of every pixel, the way
+// nms_image did before it used a running max filter.
+image nms_image_reference(image im, int w)
+{
+    image r = copy_image(im);
+    int i, j, k, l;
+    for(j = 0; j < im.h; ++j){
+        for(i = 0; i < im.w; ++i){
+            float center = im.data[j*im.w + i];
+            int suppressed = 0;
+            for(l = j - w; l <= j + w && !suppressed; ++l){
+                for(k = i - w; k <= i + w; ++k){
+                    if(k < 0 || k >= im.w || l < 0 || l >= im.h) continue;
+                    if(im.data[l*im.w + k] > center){
+                        suppressed = 1;
+                        break;
+                    }
+                }
+            }
+            if(suppressed) r.data[j*im.w + i] = -999999;
+        }
+    }
+    return r;
+}
+
+void test_fast_nms(){
+    image im = load_image("data/dog.jpg");
+    image S = structure_matrix(im, 2);
+    image R = cornerness_response(S);
+
+    // Coarse values give plenty of ties, which must be kept like before.
+    image ties = make_random_image(61, 37, 1);
+    int i, r;
+    for(i = 0; i < ties.w*ties.h; ++i) ties.data[i] = floorf(ties.data[i]*6);
+
+    int same_r = 1, same_ties = 1;
+    for(r = 0; r <= 15; ++r){
+        image a = nms_image(R, r);
+        image b = nms_image_reference(R, r);
+        same_r &= !memcmp(a.data, b.data, R.w*R.h*sizeof(float));
+        free_image(a);
+        free_image(b);
+
+        a = nms_image(ties, r);
+        b = nms_image_reference(ties, r);
+        same_ties &= !memcmp(a.data, b.data, ties.w*ties.h*sizeof(float));
+        free_image(a);
+        free_image(b);
+    }
+    TEST(same_r);
+    TEST(same_ties);
+
+    // Radii larger than the image clip to it.
+    image a = nms_image(ties, 100);
+    image b = nms_image_reference(ties, 100);
+    TEST(!memcmp(a.data, b.data, ties.w*ties.h*sizeof(float)));
+
+    free_image(a);
+    free_image(b);
+    free_image(im);
+    free_image(S);
+    free_image(R);
+    free_image(ties);
+}
+
+void test_max_features(){
+    image im = load_image("data/dog.jpg");
+    strided_image sim = image_as_strided(im);
+    panorama_options opt = {0};
+    int i, k;
+
+    descriptor_set all = harris_descriptor_set(im, 2, 50, 3);
+    int n0 = all.n;
+
+    // A cap above the corner count changes nothing.
+    opt.max_features = n0 + 10;
+    descriptor_set d = harris_descriptor_set_ex(sim, 2, 50, 3, &opt);
+    int same = d.n == n0;
+    for(i = 0; i < d.n && same; ++i) same &= d.x[i] == all.x[i] && d.y[i] == all.y[i];
+    TEST(same);
+    free_descriptor_set(d);
+
+    // A tighter cap keeps that many corners, all from the full set and from
+    // more than one part of the image.
+    int cap = n0/4;
+    opt.max_features = cap;
+    d = harris_descriptor_set_ex(sim, 2, 50, 3, &opt);
+    TEST(d.n == cap);
+    int subset = 1, left = 0, right = 0;
+    for(i = 0; i < d.n; ++i){
+        int found = 0;
+        for(k = 0; k < n0 && !found; ++k) found = d.x[i] == all.x[k] && d.y[i] == all.y[k];
+        subset &= found;
+        if(d.x[i] < im.w/2) ++left; else ++right;
+    }
+    TEST(subset);
+    TEST(left > 0 && right > 0);
+    free_descriptor_set(d);
+
+    // With a cap of one, the strongest response wins.
+    image S = structure_matrix(im, 2);
+    image R = cornerness_response(S);
+    int best = 0;
+    for(k = 1; k < n0; ++k){
+        if(R.data[(int)all.y[k]*R.w + (int)all.x[k]] > R.data[(int)all.y[best]*R.w + (int)all.x[best]]) best = k;
+    }
+    opt.max_features = 1;
+    d = harris_descriptor_set_ex(sim, 2, 50, 3, &opt);
+    TEST(d.n == 1 && d.x[0] == all.x[best] && d.y[0] == all.y[best]);
+    free_descriptor_set(d);
+
+    free_descriptor_set(all);
+    free_image(S);
+    free_image(R);
+    free_image(im);
+}
+
+void test_descriptor_set(){
+    image im = load_image("data/dog.jpg");
+    image crop = from_strided_image(image_view(im, 9, 5, im.w - 20, im.h - 12));
+    int i, n;
+    descriptor *d = harris_corner_detector(im, 2, 50, 3, &n);
+    descriptor_set s = harris_descriptor_set(im, 2, 50, 3);
+
+    TEST(s.n == n && s.dim == 75);
+    TEST((size_t)s.rows.data % 64 == 0 && s.rows.stride % 16 == 0);
+    int same = 1, padded = 1;
+    for(i = 0; i < n && i < s.n; ++i){
+        float *row = strided_row(s.rows, 0, i);
+        same &= s.x[i] == d[i].p.x && s.y[i] == d[i].p.y;
+        same &= !memcmp(row, d[i].data, s.dim*sizeof(float));
+        int k;
+        for(k = s.dim; k < s.rows.stride; ++k) padded &= row[k] == 0;
+    }
+    TEST(same);
+    TEST(padded);
+
+    // Matching sets gives what matching the arrays does.
+    int bn, mn, smn;
+    descriptor *bd = harris_corner_detector(crop, 2, 50, 3, &bn);
+    descriptor_set bs = harris_descriptor_set(crop, 2, 50, 3);
+    match *m = match_descriptors(d, n, bd, bn, &mn);
+    match *sm = match_descriptor_sets(s, bs, &smn);
+    TEST(mn == smn && mn > 0);
+    TEST(mn == smn && !memcmp(m, sm, mn*sizeof(match)));
+
+    // And the array adapter round-trips.
+    descriptor *back = descriptor_set_to_array(s);
+    same = 1;
+    for(i = 0; i < n; ++i){
+        same &= back[i].n == d[i].n && back[i].p.x == d[i].p.x && back[i].p.y == d[i].p.y;
+        same &= !memcmp(back[i].data, d[i].data, d[i].n*sizeof(float));
+    }
+    TEST(same);
+
+    free_descriptors(back, n);
+    free(m);
+    free(sm);
+    free_descriptors(d, n);
+    free_descriptors(bd, bn);
+    free_descriptor_set(s);
+    free_descriptor_set(bs);
+    free_image(crop);
+    free_image(im);
+}
+
+void test_l1_nearest_two(){
+    int i, j, k, n = 203, dim = 75;
+    image noise = make_random_image(dim, n + 1, 1);
+    descriptor_set s = make_descriptor_set(n, dim);
+    descriptor_set q = make_descriptor_set(1, dim);
+    for(i = 0; i < n; ++i) memcpy(strided_row(s.rows, 0, i), noise.data + i*dim, dim*sizeof(float));
+    memcpy(q.rows.data, noise.data + n*dim, dim*sizeof(float));
+    // An exact duplicate of an earlier row: the earlier one must win the tie.
+    memcpy(strided_row(s.rows, 0, 150), strided_row(s.rows, 0, 17), dim*sizeof(float));
+
+    int ranges[4][2] = {{0, n}, {5, 6}, {3, 150}, {17, 151}};
+    int ok = 1;
+    for(k = 0; k < 4; ++k){
+        int best = -1;
+        float d1 = FLT_MAX, d2 = FLT_MAX;
+        for(i = ranges[k][0]; i < ranges[k][1]; ++i){
+            float d = 0;
+            for(j = 0; j < dim; ++j) d += fabsf(q.rows.data[j] - strided_row(s.rows, 0, i)[j]);
+            if(d < d1){ d2 = d1; d1 = d; best = i; }
+            else if(d < d2) d2 = d;
+        }
+        nearest_two r = l1_nearest_two(q.rows.data, s.rows, ranges[k][0], ranges[k][1]);
+        ok &= r.best == best && fabsf(r.d1 - d1) < 1e-4 && fabsf(r.d2 - d2) < 1e-4;
+    }
+    TEST(ok);
+
+    // Querying with a row that is in the set finds it at distance 0.
+    nearest_two self = l1_nearest_two(strided_row(s.rows, 0, 150), s.rows, 0, n);
+    TEST(self.best == 17 && self.d1 == 0 && self.d2 == 0);
+
+    nearest_two none = l1_nearest_two(q.rows.data, s.rows, 7, 7);
+    TEST(none.best == -1);
+
+    free_image(noise);
+    free_descriptor_set(s);
+    free_descriptor_set(q);
+}
+
+void test_threaded_matching(){
+    image im = load_image("data/dog.jpg");
+    image crop = from_strided_image(image_view(im, 9, 5, im.w - 20, im.h - 12));
+    descriptor_set a = harris_descriptor_set(im, 2, 50, 3);
+    descriptor_set b = harris_descriptor_set(crop, 2, 50, 3);
+    int threads = uwimg_get_num_threads();
+    int sn, pn;
+
+    uwimg_set_num_threads(1);
+    match *serial = match_descriptor_sets(a, b, &sn);
+    uwimg_set_num_threads(5);
+    match *parallel = match_descriptor_sets(a, b, &pn);
+    TEST(sn == pn && sn > 0);
+    TEST(sn == pn && !memcmp(serial, parallel, sn*sizeof(match)));
+
+    uwimg_set_num_threads(threads);
+    free(serial);
+    free(parallel);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(crop);
+    free_image(im);
+}
+
+void test_ann_matching(){
+    image im = load_image("data/dog.jpg");
+    image crop = from_strided_image(image_view(im, 9, 5, im.w - 20, im.h - 12));
+    descriptor_set a = harris_descriptor_set(im, 2, 50, 3);
+    descriptor_set b = harris_descriptor_set(crop, 2, 50, 3);
+    panorama_options opt = {0};
+    int threads = uwimg_get_num_threads();
+    int i, en, an, tn;
+
+    match *exact = match_descriptor_sets(a, b, &en);
+
+    // Enough checks to cover all of b falls back to the exhaustive search.
+    opt.ann_checks = b.n;
+    match *all = match_descriptor_sets_ex(a, b, &an, &opt);
+    TEST(an == en && !memcmp(all, exact, en*sizeof(match)));
+    free(all);
+
+    // Each descriptor's approximate nearest neighbour should usually be its
+    // exact one, and can never be closer.
+    opt.ann_checks = 128;
+    match *approx = match_descriptor_sets_ex(a, b, &an, &opt);
+    int *best = calloc(a.n, sizeof(int));
+    float *dist = calloc(a.n, sizeof(float));
+    for(i = 0; i < a.n; ++i){
+        nearest_two r = l1_nearest_two(strided_row(a.rows, 0, i), b.rows, 0, b.n);
+        best[i] = r.best;
+        dist[i] = r.d1;
+    }
+    int found = 0, never_closer = 1;
+    for(i = 0; i < an; ++i){
+        found += approx[i].bi == best[approx[i].ai];
+        never_closer &= approx[i].distance >= dist[approx[i].ai];
+    }
+    TEST(an > 0 && found >= .9*an);
+    TEST(never_closer);
+
+    // And it does not depend on the thread count either.
+    uwimg_set_num_threads(1);
+    match *serial = match_descriptor_sets_ex(a, b, &tn, &opt);
+    TEST(tn == an && !memcmp(serial, approx, an*sizeof(match)));
+
+    uwimg_set_num_threads(threads);
+    free(best);
+    free(dist);
+    free(serial);
+    free(approx);
+    free(exact);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(crop);
+    free_image(im);
+}
+
+void test_l2_matching(){
+    image im = load_image("data/dog.jpg");
+    image crop = from_strided_image(image_view(im, 9, 5, im.w - 20, im.h - 12));
+    descriptor_set a = harris_descriptor_set(im, 2, 50, 3);
+    descriptor_set b = harris_descriptor_set(crop, 2, 50, 3);
+    panorama_options opt = {0};
+    int threads = uwimg_get_num_threads();
+    int i, k, mn, sn;
+
+    opt.metric = MATCH_L2;
+    match *m = match_descriptor_sets_ex(a, b, &mn, &opt);
+
+    // Every match is an exact L2 nearest neighbour and its distance is the
+    // Euclidean one, up to the rounding the norm expansion adds to squared
+    // distances (which the square root magnifies near 0).
+    int nearest = 1, distance = 1, right = 0;
+    for(i = 0; i < mn; ++i){
+        const float *q = strided_row(a.rows, 0, m[i].ai);
+        float best = FLT_MAX, chosen = 0;
+        int j;
+        for(j = 0; j < b.n; ++j){
+            const float *r = strided_row(b.rows, 0, j);
+            float d = 0;
+            for(k = 0; k < a.dim; ++k) d += (q[k] - r[k])*(q[k] - r[k]);
+            if(d < best) best = d;
+            if(j == m[i].bi) chosen = d;
+        }
+        nearest &= chosen <= best + 1e-4;
+        distance &= fabsf(m[i].distance*m[i].distance - chosen) < 1e-4;
+        right += m[i].p.x - m[i].q.x == 9 && m[i].p.y - m[i].q.y == 5;
+    }
+    TEST(nearest);
+    TEST(distance);
+    TEST(mn > 0 && right >= .9*mn);
+
+    // Rows of a not a multiple of the kernel's, and the thread count, change
+    // nothing.
+    uwimg_set_num_threads(1);
+    match *serial = match_descriptor_sets_ex(a, b, &sn, &opt);
+    TEST(sn == mn && !memcmp(serial, m, mn*sizeof(match)));
+    a.n -= 3;
+    free(serial);
+    serial = match_descriptor_sets_ex(a, b, &sn, &opt);
+    int kept = 1;
+    for(i = 0; i < sn; ++i) kept &= serial[i].ai < a.n;
+    TEST(sn > 0 && kept);
+
+    uwimg_set_num_threads(threads);
+    free(serial);
+    free(m);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(crop);
+    free_image(im);
+}
+
+void test_match_filters(){
+    image im = load_image("data/dog.jpg");
+    image crop = from_strided_image(image_view(im, 9, 5, im.w - 20, im.h - 12));
+    descriptor_set a = harris_descriptor_set(im, 2, 50, 3);
+    descriptor_set b = harris_descriptor_set(crop, 2, 50, 3);
+    panorama_options opt = {0};
+    int threads = uwimg_get_num_threads();
+    int i, pn, rn, mn, sn;
+
+    match *plain = match_descriptor_sets(a, b, &pn);
+
+    // Kept matches pass the ratio test against an independent search, and
+    // filtering drops the ambiguous ones rather than the right ones.
+    opt.match_ratio = .8;
+    match *r = match_descriptor_sets_ex(a, b, &rn, &opt);
+    int passes = 1, right = 0, plain_right = 0;
+    for(i = 0; i < rn; ++i){
+        nearest_two near = l1_nearest_two(strided_row(a.rows, 0, r[i].ai), b.rows, 0, b.n);
+        passes &= near.best == r[i].bi && near.d1 < .8*near.d2;
+        right += r[i].p.x - r[i].q.x == 9 && r[i].p.y - r[i].q.y == 5;
+    }
+    for(i = 0; i < pn; ++i) plain_right += plain[i].p.x - plain[i].q.x == 9 && plain[i].p.y - plain[i].q.y == 5;
+    TEST(rn > 0 && rn < pn && passes);
+    TEST((float)right/rn >= (float)plain_right/pn);
+
+    // Kept matches are nearest in both directions, found by searching back
+    // from b (ties go to the lower index either way).
+    opt.match_ratio = 0;
+    opt.match_mutual = 1;
+    match *m = match_descriptor_sets_ex(a, b, &mn, &opt);
+    int both = 1;
+    for(i = 0; i < mn; ++i){
+        nearest_two back = l1_nearest_two(strided_row(b.rows, 0, m[i].bi), a.rows, 0, a.n);
+        both &= back.best == m[i].ai;
+    }
+    TEST(mn > 0 && mn <= pn && both);
+
+    // Every match of plain that is also nearest backwards survives.
+    int mutual_plain = 0;
+    for(i = 0; i < pn; ++i){
+        mutual_plain += l1_nearest_two(strided_row(b.rows, 0, plain[i].bi), a.rows, 0, a.n).best == plain[i].ai;
+    }
+    TEST(mn == mutual_plain);
+
+    // The columns come out the same whatever order the threads fill them in,
+    // for L2 as well.
+    uwimg_set_num_threads(1);
+    match *serial = match_descriptor_sets_ex(a, b, &sn, &opt);
+    TEST(sn == mn && !memcmp(serial, m, mn*sizeof(match)));
+    free(serial);
+    opt.metric = MATCH_L2;
+    match *l2 = match_descriptor_sets_ex(a, b, &sn, &opt);
+    uwimg_set_num_threads(5);
+    match *l2_threaded = match_descriptor_sets_ex(a, b, &mn, &opt);
+    TEST(sn > 0 && sn == mn && !memcmp(l2, l2_threaded, mn*sizeof(match)));
+
+    uwimg_set_num_threads(threads);
+    free(l2);
+    free(l2_threaded);
+    free(m);
+    free(r);
+    free(plain);
+    free_descriptor_set(a);
+    free_descriptor_set(b);
+    free_image(crop);
+    free_image(im);
+}
+
+void test_ransac(){
+    // 60 matches that follow a slightly perspective homography among 40 that
+    // do not.
+    double h[9] = {1.02, .05, 30, -.03, .98, -12, 1e-5, -2e-5, 1};
+    matrix H = make_matrix(3, 3);
+    match m[100], copy[100], line[4];
+    int i;
+    for(i = 0; i < 9; ++i) H.data[i/3][i%3] = h[i];
+    srand(7);
+    for(i = 0; i < 100; ++i){
+        memset(m + i, 0, sizeof(match));
+        m[i].p = make_point(rand()%500, rand()%400);
+        m[i].q = i%5 < 3 ? project_point(H, m[i].p) : make_point(rand()%500, rand()%400);
+        m[i].ai = m[i].bi = i;
+    }
+    memcpy(copy, m, sizeof(m));
+
+    // RANSAC finds it without moving the matches.
+    matrix R = RANSAC(m, 100, 1, 500, 100);
+    TEST(!memcmp(copy, m, sizeof(m)));
+    int close = 1;
+    for(i = 0; i < 9; ++i) close &= fabs(R.data[i/3][i%3] - h[i]) < 1e-3*fmax(fabs(h[i]), 1e-2);
+    TEST(close);
+    TEST(model_inliers(R, m, 100, 1) == 60);
+    free_matrix(R);
+
+    // The least-squares solver fits four exact matches too.
+    for(i = 0; i < 4; ++i) copy[i] = m[5*i];
+    R = compute_homography(copy, 4);
+    TEST(R.data[2][2] == 1 && model_inliers(R, copy, 4, .1) == 4);
+    free_matrix(R);
+
+    // Points on a line have no homography, leaving the default shift.
+    for(i = 0; i < 4; ++i){
+        memset(line + i, 0, sizeof(match));
+        line[i].p = make_point(10*i, 5*i);
+        line[i].q = make_point(10*i + 3, 5*i);
+    }
+    R = RANSAC(line, 4, 1, 50, 4);
+    TEST(R.data[0][2] == 256 && R.data[1][2] == 0);
+    free_matrix(R);
+    free_matrix(H);
+}
+
+void test_adaptive_ransac(){
+    // 60 matches that follow a homography among 40 that do not.
+    double h[9] = {1.02, .05, 30, -.03, .98, -12, 1e-5, -2e-5, 1};
+    matrix H = make_matrix(3, 3);
+    match m[100];
+    panorama_options opt = {0};
+    ransac_stats all, adaptive, early;
+    int i;
+    for(i = 0; i < 9; ++i) H.data[i/3][i%3] = h[i];
+    srand(7);
+    for(i = 0; i < 100; ++i){
+        memset(m + i, 0, sizeof(match));
+        m[i].p = make_point(rand()%500, rand()%400);
+        m[i].q = i%5 < 3 ? project_point(H, m[i].p) : make_point(rand()%500, rand()%400);
+    }
+
+    // By default every iteration scores every match, as it always has.
+    matrix R = RANSAC_ex(m, 100, 1, 2000, 100, 0, &all);
+    TEST(all.iterations == 2000 && all.checks == 2000L*100);
+    TEST(model_inliers(R, m, 100, 1) == 60);
+    free_matrix(R);
+
+    // At 99% confidence a 60% inlier ratio needs a few dozen samples.
+    opt.ransac_confidence = .99;
+    R = RANSAC_ex(m, 100, 1, 2000, 100, &opt, &adaptive);
+    TEST(adaptive.iterations < 100);
+    TEST(model_inliers(R, m, 100, 1) == 60);
+    free_matrix(R);
+
+    // The SPRT gives up on bad hypotheses early and still finds the model.
+    opt.ransac_confidence = 0;
+    opt.ransac_sprt = 1;
+    R = RANSAC_ex(m, 100, 1, 2000, 100, &opt, &early);
+    TEST(early.iterations == 2000 && early.checks < all.checks/2);
+    TEST(model_inliers(R, m, 100, 1) == 60);
+    free_matrix(R);
+
+    free_matrix(H);
+}
+
+void test_prosac(){
+    // 200 matches best first: the first 30 follow a homography, then a fifth
+    // of the rest do. A third are inliers.
+    double h[9] = {1.02, .05, 30, -.03, .98, -12, 1e-5, -2e-5, 1};
+    matrix H = make_matrix(3, 3);
+    match m[200], reversed[200];
+    panorama_options opt = {0};
+    ransac_stats prosac, late, uniform;
+    int i, inliers = 0;
+    for(i = 0; i < 9; ++i) H.data[i/3][i%3] = h[i];
+    srand(7);
+    for(i = 0; i < 200; ++i){
+        memset(m + i, 0, sizeof(match));
+        m[i].p = make_point(rand()%500, rand()%400);
+        int in = i < 30 || i%5 == 0;
+        m[i].q = in ? project_point(H, m[i].p) : make_point(rand()%500, rand()%400);
+        inliers += in;
+    }
+    for(i = 0; i < 200; ++i) reversed[i] = m[199 - i];
+    opt.sampler = SAMPLE_PROSAC;
+
+    // Stopping at the cutoff, PROSAC draws an all-inlier sample straight
+    // from the best matches.
+    matrix R = RANSAC_ex(m, 200, 1, 5000, inliers - 1, &opt, &prosac);
+    TEST(prosac.iterations <= 3 && model_inliers(R, m, 200, 1) == inliers);
+    free_matrix(R);
+
+    // With the best matches ranked last it widens to all of them and still
+    // finds the model, like uniform sampling.
+    R = RANSAC_ex(reversed, 200, 1, 5000, inliers - 1, &opt, &late);
+    TEST(late.iterations < 5000 && model_inliers(R, reversed, 200, 1) == inliers);
+    free_matrix(R);
+    R = RANSAC_ex(m, 200, 1, 5000, inliers - 1, 0, &uniform);
+    TEST(uniform.best_iteration == uniform.iterations && model_inliers(R, m, 200, 1) == inliers);
+    free_matrix(R);
+
+    // Its own stopping rule ends the search once the best-ranked matches
+    // agree, but not while a bad ranking keeps it guessing.
+    opt.ransac_confidence = .99;
+    opt.ransac_sprt = 1;
+    R = RANSAC_ex(m, 200, 1, 5000, 200, &opt, &prosac);
+    TEST(prosac.iterations < 10 && model_inliers(R, m, 200, 1) == inliers);
+    free_matrix(R);
+    R = RANSAC_ex(reversed, 200, 1, 5000, 200, &opt, 0);
+    TEST(model_inliers(R, reversed, 200, 1) == inliers);
+    free_matrix(R);
+
+    free_matrix(H);
+}
+
+void test_binary_descriptors(){
+    image im = load_image("data/dog.jpg");
+    image crop = from_strided_image(image_view(im, 9, 5, im.w - 20, im.h - 12));
+    binary_descriptor_set a = harris_binary_descriptor_set(im, 2, 50, 3);
+    binary_descriptor_set b = harris_binary_descriptor_set(crop, 2, 50, 3);
+    descriptor_set f = harris_descriptor_set(im, 2, 50, 3);
+    int i, w, mn;
+
+    // Same corners as the float descriptors, and bits that are neither
+    // always set nor always clear.
+    int same = a.n == f.n, ones = 0;
+    for(i = 0; i < a.n && same; ++i) same &= a.x[i] == f.x[i] && a.y[i] == f.y[i];
+    for(i = 0; i < a.n*BINARY_DESCRIPTOR_WORDS; ++i) ones += __builtin_popcountll(a.bits[i]);
+    TEST(same);
+    TEST(ones > a.n*256/4 && ones < a.n*256*3/4);
+
+    // The crop is the same pixels shifted, so most matches recover the shift.
+    match *m = match_binary_descriptor_sets(a, b, &mn);
+    int right = 0, exact_bits = 1;
+    for(i = 0; i < mn; ++i){
+        right += m[i].p.x - m[i].q.x == 9 && m[i].p.y - m[i].q.y == 5;
+        if(m[i].distance == 0){
+            for(w = 0; w < BINARY_DESCRIPTOR_WORDS; ++w){
+                exact_bits &= a.bits[m[i].ai*BINARY_DESCRIPTOR_WORDS + w] == b.bits[m[i].bi*BINARY_DESCRIPTOR_WORDS + w];
+            }
+        }
+    }
+    TEST(mn > 0 && right >= .9*mn);
+    TEST(exact_bits);
+
+    free(m);
+    free_binary_descriptor_set(a);
+    free_binary_descriptor_set(b);
+    free_descriptor_set(f);
+    free_image(crop);
+    free_image(im);
+}
+
+void test_quantized_descriptors(){
+    image im = load_image("data/dog.jpg");
+    image crop = from_strided_image(image_view(im, 9, 5, im.w - 20, im.h - 12));
+    descriptor_set fa = harris_descriptor_set(im, 2, 50, 3);
+    descriptor_set fb = harris_descriptor_set(crop, 2, 50, 3);
+    quantized_descriptor_set a = harris_quantized_descriptor_set(im, 2, 50, 3);
+    quantized_descriptor_set b = harris_quantized_descriptor_set(crop, 2, 50, 3);
+    quantized_descriptor_set qa = quantize_descriptor_set(fa);
+    quantized_descriptor_set vb = harris_quantized_descriptor_set_strided(image_view(im, 9, 5, im.w - 20, im.h - 12),
+                                                                          2, 50, 3);
+    int i, k, mn, fn;
+
+    // Describing straight to bytes and quantizing the floats agree, every
+    // value is within half a step of its float, and padding reads as 0.
+    TEST(a.n == fa.n && a.dim == fa.dim && a.stride % 32 == 0 && (size_t)a.rows % 64 == 0);
+    TEST(a.n == qa.n && !memcmp(a.rows, qa.rows, (size_t)a.n*a.stride));
+    int close = 1, padded = 1;
+    for(i = 0; i < a.n; ++i){
+        for(k = 0; k < a.dim; ++k){
+            float v = (a.rows[i*a.stride + k] - 128) / (float)QUANTIZED_DESCRIPTOR_SCALE;
+            close &= fabsf(v - strided_row(fa.rows, 0, i)[k]) <= .5f/QUANTIZED_DESCRIPTOR_SCALE + 1e-6;
+        }
+        for(; k < a.stride; ++k) padded &= a.rows[i*a.stride + k] == 128;
+    }
+    TEST(close);
+    TEST(padded);
+
+    // Describing a view gives the same set as describing a copy of it.
+    TEST(vb.n == b.n && !memcmp(vb.x, b.x, 2*b.n*sizeof(float)) && !memcmp(vb.rows, b.rows, (size_t)b.n*b.stride));
+
+    // Matching recovers the shift and mostly agrees with the float matches.
+    match *m = match_quantized_descriptor_sets(a, b, &mn);
+    match *fm = match_descriptor_sets(fa, fb, &fn);
+    int right = 0, agree = 0;
+    int *float_bi = calloc(a.n, sizeof(int));
+    for(i = 0; i < a.n; ++i) float_bi[i] = -1;
+    for(i = 0; i < fn; ++i) float_bi[fm[i].ai] = fm[i].bi;
+    for(i = 0; i < mn; ++i){
+        right += m[i].p.x - m[i].q.x == 9 && m[i].p.y - m[i].q.y == 5;
+        agree += float_bi[m[i].ai] == m[i].bi;
+    }
+    TEST(mn > 0 && right >= .9*mn);
+    TEST(agree >= .95*mn);
+
+    free(float_bi);
+    free(m);
+    free(fm);
+    free_descriptor_set(fa);
+    free_descriptor_set(fb);
+    free_quantized_descriptor_set(a);
+    free_quantized_descriptor_set(b);
+    free_quantized_descriptor_set(qa);
+    free_quantized_descriptor_set(vb);
+    free_image(crop);
+    free_image(im);
+}
+
 void test_structure()
 {
     image im = load_image("data/dogbw.png");
@@ -384,12 +1489,71 @@ void test_cornerness()
     free_image(gt);
 }
 
+// Runs a set of operations with one thread and with several, which must
+// give bit-identical results.
+image *threaded_outputs(image im, int threads){
+    uwimg_set_num_threads(threads);
+    image *out = calloc(8, sizeof(image));
+    image box = make_box_filter(7);
+    image emboss = make_emboss_filter();
+    image big = make_random_image(21, 21, 1);
+    out[0] = convolve_image(im, box, 1);
+    out[1] = convolve_image(im, emboss, 0);
+    out[2] = convolve_image(im, big, 1);
+    out[3] = bilinear_resize(im, 713, 467);
+    out[4] = copy_image(im);
+    rgb_to_hsv(out[4]);
+    out[5] = smooth_image(im, 4, 2);
+    out[6] = structure_matrix(im, 2);
+    matrix H = make_translation_homography(40, 30);
+    out[7] = combine_images(im, im, H);
+    free_matrix(H);
+    free_image(box);
+    free_image(emboss);
+    free_image(big);
+    return out;
+}
+
+// Tries to resize the thread pool from inside one of its own jobs.
+static void set_threads_rows(void *ctx, int start, int end){
+    int *refused = ctx;
+    if(!uwimg_set_num_threads(3)) __atomic_fetch_add(refused, 1, __ATOMIC_RELAXED);
+}
+
+void test_threads(){
+    image im = load_image("data/dog.jpg");
+    int threads = uwimg_get_num_threads();
+    image *serial = threaded_outputs(im, 1);
+    image *parallel = threaded_outputs(im, 5);
+    int i;
+    for(i = 0; i < 8; ++i){
+        TEST(identical_image(serial[i], parallel[i]));
+        free_image(serial[i]);
+        free_image(parallel[i]);
+    }
+    free(serial);
+    free(parallel);
+
+    // Resizing the pool from inside a job is refused rather than deadlocking.
+    int refused = 0;
+    uwimg_set_num_threads(4);
+    parallel_for(8, 1, set_threads_rows, &refused);
+    TEST(refused == 8 && uwimg_get_num_threads() == 4);
+
+    uwimg_set_num_threads(threads);
+    free_image(im);
+}
+
 void run_tests()
 {
     //test_matrix();
     test_get_pixel();
     test_set_pixel();
     test_copy();
+    test_image_pool();
+    test_strided_image();
+    test_image_view();
+    test_u8_conversion();
     test_shift();
     test_grayscale();
     test_rgb_to_hsv();
@@ -402,10 +1566,31 @@ void run_tests()
     test_emboss_filter();
     test_highpass_filter();
     test_convolution();
+    test_separable_convolution();
+    test_fft_convolution();
+    test_fft_path();
+    test_border_modes();
     test_gaussian_blur();
+    test_recursive_gaussian();
     test_hybrid_image();
     test_frequency_image();
     test_sobel();
+    test_sobel_gradients();
+    test_fused_structure();
+    test_fast_nms();
+    test_max_features();
+    test_descriptor_set();
+    test_l1_nearest_two();
+    test_threaded_matching();
+    test_ann_matching();
+    test_l2_matching();
+    test_match_filters();
+    test_ransac();
+    test_adaptive_ransac();
+    test_prosac();
+    test_binary_descriptors();
+    test_quantized_descriptors();
+    test_threads();
     test_structure();
     test_cornerness();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
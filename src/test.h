@@ -1,6 +1,7 @@
 #ifndef TEST_H
 #define TEST_H
 #include <stdio.h>
+#include "image.h"
 #define EPS .005
 extern int tests_total;
 extern int tests_fail;
@@ -9,4 +10,9 @@ extern int tests_fail;
     ++tests_fail; }} while (0)
 
 void run_tests();
+double what_time_is_it_now();
+image make_random_image(int w, int h, int c);
+image structure_matrix_reference(image im, float sigma);
+image nms_image_reference(image im, int w);
+void run_benchmarks();
 #endif
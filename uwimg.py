@@ -43,6 +43,17 @@ class DESCRIPTOR(Structure):
                 ("n", c_int),
                 ("data", POINTER(c_float))]
 
+# Mirrors panorama_options in image.h; left zeroed, every setting is off.
+class PANORAMA_OPTIONS(Structure):
+    _fields_ = [("max_features", c_int),
+                ("ann_checks", c_int),
+                ("metric", c_int),
+                ("match_ratio", c_float),
+                ("match_mutual", c_int),
+                ("sampler", c_int),
+                ("ransac_confidence", c_float),
+                ("ransac_sprt", c_int)]
+
 add_image = lib.add_image
 add_image.argtypes = [IMAGE, IMAGE]
 add_image.restype = IMAGE
@@ -51,6 +62,14 @@ sub_image = lib.sub_image
 sub_image.argtypes = [IMAGE, IMAGE]
 sub_image.restype = IMAGE
 
+uwimg_set_num_threads = lib.uwimg_set_num_threads
+uwimg_set_num_threads.argtypes = [c_int]
+uwimg_set_num_threads.restype = c_int
+
+set_image_pool_limit = lib.set_image_pool_limit
+set_image_pool_limit.argtypes = [c_size_t]
+set_image_pool_limit.restype = None
+
 make_image = lib.make_image
 make_image.argtypes = [c_int, c_int, c_int]
 make_image.restype = IMAGE
@@ -155,6 +174,10 @@ sobel_image = lib.sobel_image
 sobel_image.argtypes = [IMAGE]
 sobel_image.restype = POINTER(IMAGE)
 
+sobel_gradients = lib.sobel_gradients
+sobel_gradients.argtypes = [IMAGE, c_int]
+sobel_gradients.restype = POINTER(IMAGE)
+
 colorize_sobel = lib.colorize_sobel
 colorize_sobel.argtypes = [IMAGE]
 colorize_sobel.restype = IMAGE
@@ -171,6 +194,9 @@ harris_corner_detector = lib.harris_corner_detector
 harris_corner_detector.argtypes = [IMAGE, c_float, c_float, c_int, POINTER(c_int)]
 harris_corner_detector.restype = POINTER(DESCRIPTOR)
 
+MATCH_L1, MATCH_L2 = 0, 1
+SAMPLE_UNIFORM, SAMPLE_PROSAC = 0, 1
+
 mark_corners = lib.mark_corners
 mark_corners.argtypes = [IMAGE, POINTER(DESCRIPTOR), c_int]
 mark_corners.restype = None
@@ -191,13 +217,16 @@ find_and_draw_matches = lib.find_and_draw_matches
 find_and_draw_matches.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int]
 find_and_draw_matches.restype = IMAGE
 
-panorama_image_lib = lib.panorama_image
-panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int]
+panorama_image_lib = lib.panorama_image_ex
+panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int, POINTER(PANORAMA_OPTIONS)]
 panorama_image_lib.restype = IMAGE
 
 
 
-def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
+def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30, sampler=SAMPLE_UNIFORM,
+                   options=None):
+    if options is None:
+        options = PANORAMA_OPTIONS(sampler=sampler)
     #print(a.data is b.data)
 
     print("Address stored in a.data:", ctypes.cast(a.data, ctypes.c_void_p).value)
@@ -205,7 +234,7 @@ def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000,
     print(f"a: {a} w={a.w}, h={a.h}, c={a.c}, data={a.data}")
     print(f"b: {b} w={b.w}, h={b.h}, c={b.c}, data={b.data}")
     print(panorama_image_lib)
-    return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
+    return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff, byref(options))
 
 
 optical_flow_images = lib.optical_flow_images